@@ -0,0 +1,221 @@
+#!/bin/bash
+#
+# bench.sh - time unyaffs on a matrix of synthetic images (make bench)
+#
+# usage: bench.sh [<unyaffs options>]
+#
+# For each profile and flash layout an image is generated with yaffsgen,
+# then listed, extracted (with the given unyaffs options) and the
+# extracted tree is verified. The images are generated again for every
+# run, the same options always give the same images. The times are
+# wall clock seconds with a warm page cache.
+# The column detect checks the layout detection: a copy of the image
+# behind a hole of about 15 times its size (a sparse file, most sample
+# windows see only zeros) is listed without -l, the listing must be the
+# same as the one of the image.
+# The column extents is the number of extents of all extracted files
+# (filefrag), it shows how fragmented the files are written.
+#
+# The full scan (-f) is checked on an image with older versions of 30%
+# of the objects, like a used partition (yaffsgen -u), the extracted tree
+# must be the current one.
+#
+# Then the preallocation of files is compared: 4 extractions of the
+# same image run at once, with and without --no-prealloc, and the total
+# extents and the wall time of the 4 are printed.
+#
+# The experimental io_uring backend (-u) is compared with the
+# synchronous writes on the small and large profile, the best of 3
+# alternating runs each.
+#
+# Afterwards the batch mode is checked: a list of good images with
+# missing ones in between is extracted with -j 8, all good images must
+# be extracted and verified, only the missing ones may fail.
+#
+# BENCH_DIR	work directory (default bench.tmp), removed at the end
+# BENCH_PROFILES	profiles to run (default "small large mixed interleaved")
+
+UNYAFFS=./unyaffs
+YAFFSGEN=./yaffsgen
+BENCH_DIR=${BENCH_DIR:-bench.tmp}
+BENCH_PROFILES=${BENCH_PROFILES:-small large mixed interleaved}
+
+# yaffsgen options of the profiles
+profile_opts() {
+	case $1 in
+		small)	echo "-n 20000 -d 8 -s 0-8192" ;;
+		large)	echo "-n 400 -d 3 -s 65536-4194304 -m zero=10" ;;
+		mixed)	echo "-n 5000 -d 6 -s 0-1048576 -e 5" ;;
+		interleaved) echo "-n 5000 -d 6 -s 0-1048576 -i 16" ;;
+		*)	echo "unknown profile $1" >&2; exit 1 ;;
+	esac
+}
+
+# additional unyaffs options of the profiles
+profile_unyaffs() {
+	case $1 in
+		interleaved) echo "-m" ;;
+	esac
+}
+
+# run a command, print its wall time
+timed() {
+	local TIMEFORMAT=%R
+	{ time "$@" > /dev/null 2> "$BENCH_DIR/err" ; } 2>&1
+}
+
+# the smaller of two times, the second may be empty
+min_time() {
+	awk -v a="$1" -v b="$2" 'BEGIN { print (b == "" || a < b) ? a : b }'
+}
+
+# count the extents of all files below the given directories
+count_extents() {
+	if type filefrag > /dev/null 2>&1; then
+		find "$@" -type f -exec filefrag {} + 2> /dev/null |
+		awk '{ n += $(NF-2) } END { print n + 0 }'
+	else
+		echo -
+	fi
+}
+
+mkdir -p "$BENCH_DIR" || exit 1
+trap 'rm -rf "$BENCH_DIR"' EXIT
+
+failed=0
+printf "%-14s %6s %9s %8s %9s %8s %8s %7s %7s\n" \
+       image "MB" generate list extract "MB/s" extents verify detect
+for profile in $BENCH_PROFILES; do
+	opts=$(profile_opts $profile) || exit 1
+	uopts=$(profile_unyaffs $profile)
+	for layout in 1 2 3 4; do
+		name=$profile-$layout
+		img="$BENCH_DIR/$name.img"
+		dir="$BENCH_DIR/$name"
+		t_gen=$(timed $YAFFSGEN -l $layout $opts "$img")
+		size=$(($(wc -c < "$img") / 1000000))
+		t_list=$(timed $UNYAFFS -l $layout $uopts -t "$img")
+		t_extract=$(timed $UNYAFFS -l $layout $uopts "$@" "$img" "$dir")
+		if [ -s "$BENCH_DIR/err" ]; then
+			sed "s/^/$name: /" "$BENCH_DIR/err" | head -5 >&2
+		fi
+		extents=$(count_extents "$dir")
+		if $YAFFSGEN -l $layout $opts -c "$dir" 2> "$BENCH_DIR/err"; then
+			verify=ok
+		else
+			verify=FAIL
+			failed=1
+			sed "s/^/$name: /" "$BENCH_DIR/err" | head -5 >&2
+		fi
+		chunk_len=$((2112 << (layout - 1)))
+		hole=$(( ($(wc -c < "$img") / chunk_len * 15 + 63) / 64 * 64 ))
+		dd if="$img" of="$img.sparse" bs=$chunk_len seek=$hole status=none
+		if cmp -s <($UNYAFFS -l $layout $uopts -t "$img" 2>&1) \
+		          <($UNYAFFS $uopts -t "$img.sparse" 2>&1); then
+			detect=ok
+		else
+			detect=FAIL
+			failed=1
+		fi
+		rate=$(awk "BEGIN { t = $t_extract; printf \"%.0f\", (t > 0 ? $size / t : 0) }")
+		printf "%-14s %6d %9s %8s %9s %8s %8s %7s %7s\n" \
+		       $name $size $t_gen $t_list $t_extract $rate $extents \
+		       $verify $detect
+		rm -rf "$img" "$img.sparse" "$dir"
+	done
+done
+
+# full scan of superseded and deleted objects
+opts="-n 5000 -d 6 -s 0-1048576 -u 30"
+$YAFFSGEN -l 1 $opts "$BENCH_DIR/full.img"
+t_extract=$(timed $UNYAFFS -f -l 1 "$@" "$BENCH_DIR/full.img" "$BENCH_DIR/full")
+if $YAFFSGEN -l 1 $opts -c "$BENCH_DIR/full" 2> "$BENCH_DIR/err"; then
+	echo "full scan: ok ($t_extract s)"
+else
+	echo "full scan: FAIL"
+	head -5 "$BENCH_DIR/err" >&2
+	failed=1
+fi
+rm -rf "$BENCH_DIR/full.img" "$BENCH_DIR/full"
+
+# concurrent extractions with and without preallocation
+opts=$(profile_opts large)
+$YAFFSGEN -l 1 $opts "$BENCH_DIR/prealloc.img"
+printf "\n%-14s %9s %8s %7s\n" "4 at once" extract extents verify
+for prealloc in "" --no-prealloc; do
+	start=$(date +%s%N)
+	for i in 1 2 3 4; do
+		$UNYAFFS -l 1 $prealloc "$@" "$BENCH_DIR/prealloc.img" \
+		         "$BENCH_DIR/prealloc$i" > /dev/null 2>&1 &
+	done
+	wait
+	t_extract=$(awk "BEGIN { printf \"%.3f\", ($(date +%s%N) - $start) / 1e9 }")
+	extents=$(count_extents "$BENCH_DIR"/prealloc[1-4])
+	verify=ok
+	for i in 1 2 3 4; do
+		if ! $YAFFSGEN -l 1 $opts -c "$BENCH_DIR/prealloc$i" 2> "$BENCH_DIR/err"; then
+			verify=FAIL
+			failed=1
+			sed "s/^/prealloc$i: /" "$BENCH_DIR/err" | head -5 >&2
+		fi
+	done
+	printf "%-14s %9s %8s %7s\n" ${prealloc:---prealloc} $t_extract \
+	       $extents $verify
+	rm -rf "$BENCH_DIR"/prealloc[1-4]
+done
+rm -f "$BENCH_DIR/prealloc.img"
+
+# io_uring backend against synchronous writes
+printf "\n%-14s %9s %9s %7s\n" "io_uring" sync "-u" verify
+for profile in small large; do
+	opts=$(profile_opts $profile)
+	$YAFFSGEN -l 1 $opts "$BENCH_DIR/uring.img"
+	t_sync=
+	t_uring=
+	for run in 1 2 3; do		# alternating, the best of 3
+		rm -rf "$BENCH_DIR/sync" "$BENCH_DIR/uring"
+		sync			# no writeback of earlier runs meanwhile
+		t=$(timed $UNYAFFS -l 1 "$@" "$BENCH_DIR/uring.img" "$BENCH_DIR/sync")
+		t_sync=$(min_time $t $t_sync)
+		sync
+		t=$(timed $UNYAFFS -l 1 -u "$@" "$BENCH_DIR/uring.img" "$BENCH_DIR/uring")
+		t_uring=$(min_time $t $t_uring)
+	done
+	verify=ok
+	for dir in sync uring; do
+		if ! $YAFFSGEN -l 1 $opts -c "$BENCH_DIR/$dir" 2> "$BENCH_DIR/err"; then
+			verify=FAIL
+			failed=1
+			sed "s/^/$profile $dir: /" "$BENCH_DIR/err" | head -5 >&2
+		fi
+	done
+	printf "%-14s %9s %9s %7s\n" $profile $t_sync $t_uring $verify
+	rm -rf "$BENCH_DIR/uring.img" "$BENCH_DIR/sync" "$BENCH_DIR/uring"
+done
+echo
+
+# batch mode with failing images in a parallel run
+opts="-n 500 -d 4 -s 0-65536"
+$YAFFSGEN -l 1 $opts "$BENCH_DIR/batch.img"
+: > "$BENCH_DIR/batch.list"
+for i in $(seq 1 20); do
+	ln -s batch.img "$BENCH_DIR/good$i.img"
+	echo "$BENCH_DIR/good$i.img" >> "$BENCH_DIR/batch.list"
+	echo "$BENCH_DIR/missing$i.img" >> "$BENCH_DIR/batch.list"
+done
+$UNYAFFS "$@" -j 8 --batch "$BENCH_DIR/batch.list" "$BENCH_DIR/batch" \
+         > /dev/null 2> "$BENCH_DIR/err"
+bad=0
+for i in $(seq 1 20); do
+	if ! $YAFFSGEN -l 1 $opts -c "$BENCH_DIR/batch/good$i" 2>> "$BENCH_DIR/err"; then
+		bad=$((bad + 1))
+	fi
+done
+if [ $bad -eq 0 ]; then
+	echo "batch: 20 of 20 good images ok"
+else
+	echo "batch: FAIL, $bad of 20 good images wrong"
+	grep -v missing "$BENCH_DIR/err" | head -5 >&2
+	failed=1
+fi
+exit $failed
@@ -0,0 +1,1943 @@
+/*
+ * libunyaffs: read YAFFS2 file system images
+ *
+ * Created by Kai Wei <kai.wei.cn@gmail.com>
+ * Modified by Bernhard Ehlers <be@bernhard-ehlers.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* SEEK_HOLE, SEEK_DATA */
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "libunyaffs.h"
+
+#define PIPE_BLOCKS		    4	/* read buffer blocks of reader thread */
+#define OBJ_TABLE_MIN		 4096	/* initial size, power of 2 */
+#define ARENA_BLOCK_SIZE	(1024*1024)
+#define NO_HOLE			((off_t)1 << 62)
+#define PROBE_WINDOWS		   32	/* samples of the layout detection */
+#define PROBE_WINDOW_SIZE	(256*1024)
+
+#define SEQ_LOWEST		0x00001000	/* valid sequence numbers */
+#define SEQ_HIGHEST		0xefffff00
+#define EXTRA_HEADER_INFO_FLAG	0x80000000	/* header tags of the kernel */
+#define EXTRA_OBJECT_TYPE_MASK	0xf0000000
+
+const struct yaffs_layout yaffs_layouts[] =
+	{ { 2048, 64 }, { 4096, 128 }, { 8192, 256 }, { 16384, 512 } };
+
+const int yaffs_layout_count = sizeof(yaffs_layouts) / sizeof(struct yaffs_layout);
+
+/* bump allocator for objects, freed all at once */
+struct yaffs_arena {
+	struct yaffs_arena *next;
+	size_t used;
+	size_t size;
+	unsigned char mem[1];		/* variable length, must be last */
+};
+
+/*
+ * Reader thread for non-seekable images (stdin, pipes):
+ * The read buffer is split into PIPE_BLOCKS blocks, which the reader
+ * thread fills ahead, while the main thread processes the chunks.
+ * Blocks are passed in order through a lock-free single producer,
+ * single consumer ring; mutex and condition variable are only used to
+ * sleep, when the ring is empty or full. Each block has YAFFS_DETECT_SIZE
+ * bytes headroom, where the rest of the previous block is copied to,
+ * so that a chunk never gets split.
+ */
+struct t_pipe_block {
+	unsigned char *data;
+	size_t len;
+	int    err;
+	unsigned long calls;		/* read() calls */
+};
+
+struct yaffs_pipe {
+	struct t_pipe_block blk[PIPE_BLOCKS];
+	unsigned char *mem;
+	size_t block_size;
+	int    fd;
+	atomic_uint head;		/* blocks filled by reader */
+	atomic_uint tail;		/* blocks released by consumer */
+	atomic_int  waiting;
+	atomic_int  stop;		/* consumer quits before the end */
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	pthread_t  tid;
+	int  has_block;			/* consumer owns block tail */
+	int  eof;
+};
+
+static const char *err_text[] = {
+	"Success",
+	"Read image file",
+	"Out of memory",
+	"Not a yaffs2 image",
+	"Can't determine chunk size",
+	"Broken image file",
+	"Invalid object",
+	"Giving up"
+};
+
+const char *yaffs_strerror(int err) {
+	if (err < 0)
+		err = -err;
+	if (err >= sizeof(err_text) / sizeof(err_text[0]))
+		return "Unknown error";
+	return err_text[err];
+}
+
+/* detailed message of the last error */
+const char *yaffs_errmsg(yaffs_image *img) {
+	return img->err_msg;
+}
+
+/* record an error, returns the negated error code */
+static int set_error(yaffs_image *img, int err, int errnum,
+                     const char *format, ...) {
+	va_list varg;
+
+	if (format == NULL)
+		format = yaffs_strerror(err);
+	va_start(varg, format);
+	vsnprintf(img->err_msg, sizeof(img->err_msg), format, varg);
+	va_end(varg);
+	img->err_errno = errnum;
+	return -err;
+}
+
+/*
+ * read function, which handles partial and interrupted reads,
+ * the number of read() calls is added to *calls
+ */
+static ssize_t xread(int fd, void *buf, size_t len, unsigned long *calls) {
+	char *ptr = buf;
+	ssize_t offset, ret;
+
+	offset = 0;
+	while (offset < len) {
+		(*calls)++;
+		ret = read(fd, ptr+offset, len-offset);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				return -1;
+		} else if (ret == 0)
+			break;
+		else
+			offset += ret;
+	}
+	return offset;
+}
+
+/*
+ * all_ff - check if a buffer contains only 0xff bytes (erased flash).
+ * On x86 the SSE2 or AVX2 version is selected at run time, they check
+ * 64 or 128 bytes per step and stop at the first block with other bytes.
+ */
+static int all_ff_generic(const unsigned char *buf, size_t len) {
+	unsigned long long w;
+	size_t i;
+
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, buf + i, sizeof(w));
+		if (w != ~0ULL)
+			return 0;
+	}
+	for (; i < len; i++)
+		if (buf[i] != 0xff)
+			return 0;
+	return 1;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static int all_ff_sse2(const unsigned char *buf, size_t len) {
+	const __m128i *p = (const __m128i *)buf;
+	__m128i acc;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64, p += 4) {
+		acc = _mm_and_si128(_mm_and_si128(_mm_loadu_si128(p),
+		                                  _mm_loadu_si128(p + 1)),
+		                    _mm_and_si128(_mm_loadu_si128(p + 2),
+		                                  _mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_set1_epi8(-1))) != 0xffff)
+			return 0;
+	}
+	return all_ff_generic(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int all_ff_avx2(const unsigned char *buf, size_t len) {
+	const __m256i *p = (const __m256i *)buf;
+	__m256i acc;
+	size_t i;
+
+	for (i = 0; i + 128 <= len; i += 128, p += 4) {
+		acc = _mm256_and_si256(_mm256_and_si256(_mm256_loadu_si256(p),
+		                                        _mm256_loadu_si256(p + 1)),
+		                       _mm256_and_si256(_mm256_loadu_si256(p + 2),
+		                                        _mm256_loadu_si256(p + 3)));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(acc, _mm256_set1_epi8(-1))) != -1)
+			return 0;
+	}
+	return all_ff_sse2(buf + i, len - i);
+}
+#endif
+
+static int (*all_ff)(const unsigned char *buf, size_t len) = all_ff_generic;
+static pthread_once_t all_ff_once = PTHREAD_ONCE_INIT;
+
+static void all_ff_select(void) {
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		all_ff = all_ff_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		all_ff = all_ff_sse2;
+#endif
+}
+
+/*
+ * yaffs_path - full path name of an object, built from the parent chain
+ * into a per thread buffer, valid until the next call
+ */
+const char *yaffs_path(yaffs_object *obj) {
+	static __thread char *path_buf = NULL;
+	static __thread size_t path_size = 0;
+	yaffs_object *o;
+	size_t len, n;
+	char *new_buf;
+
+	if (obj->parent == NULL)		/* root */
+		return obj->name;
+
+	len = 0;
+	for (o = obj; o->parent != NULL; o = o->parent)
+		len += strlen(o->name) + 1;
+	if (len > path_size) {
+		n = len > 2 * path_size ? len : 2 * path_size;
+		if ((new_buf = realloc(path_buf, n)) == NULL)
+			return "<out of memory>";
+		path_buf = new_buf;
+		path_size = n;
+	}
+
+	path_buf[--len] = '\0';
+	for (o = obj; o->parent != NULL; o = o->parent) {
+		n = strlen(o->name);
+		len -= n;
+		memcpy(path_buf + len, o->name, n);
+		if (len > 0)
+			path_buf[--len] = '/';
+	}
+	return path_buf;
+}
+
+static void *arena_alloc(yaffs_image *img, size_t size) {
+	struct yaffs_arena *blk;
+	void *ptr;
+
+	size = (size + sizeof(off_t) - 1) & ~(sizeof(off_t) - 1);
+	if (img->arena == NULL || img->arena->size - img->arena->used < size) {
+		blk = malloc(offsetof(struct yaffs_arena, mem) +
+		             (size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE));
+		if (blk == NULL)
+			return NULL;
+		blk->next = img->arena;
+		blk->used = 0;
+		blk->size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		img->arena = blk;
+	}
+	ptr = img->arena->mem + img->arena->used;
+	img->arena->used += size;
+	return ptr;
+}
+
+static void arena_free(yaffs_image *img) {
+	struct yaffs_arena *blk;
+
+	while ((blk = img->arena) != NULL) {
+		img->arena = blk->next;
+		free(blk);
+	}
+}
+
+static inline unsigned obj_hash(yaffs_image *img, unsigned id) {
+	return (id * 2654435761U) & (img->obj_table_size - 1);
+}
+
+static int insert_object(yaffs_image *img, yaffs_object *obj) {
+	yaffs_object **old_table;
+	unsigned old_size, idx;
+
+	if (2 * (img->obj_table_used + 1) > img->obj_table_size) {	/* grow table */
+		old_table = img->obj_table;
+		old_size  = img->obj_table_size;
+		img->obj_table = calloc(old_size ? 2 * old_size : OBJ_TABLE_MIN,
+		                        sizeof(yaffs_object *));
+		if (img->obj_table == NULL) {
+			img->obj_table = old_table;
+			return -1;
+		}
+		img->obj_table_size = old_size ? 2 * old_size : OBJ_TABLE_MIN;
+		img->obj_table_used = 0;
+		for (idx = 0; idx < old_size; idx++)
+			if (old_table[idx] != NULL)
+				insert_object(img, old_table[idx]);
+		free(old_table);
+	}
+
+	idx = obj_hash(img, obj->id);
+	while (img->obj_table[idx] != NULL)
+		idx = (idx + 1) & (img->obj_table_size - 1);
+	img->obj_table[idx] = obj;
+	img->obj_table_used++;
+	return 0;
+}
+
+yaffs_object *yaffs_get_object(yaffs_image *img, unsigned id) {
+	yaffs_object *obj;
+	unsigned idx;
+
+	idx = obj_hash(img, id);
+	while ((obj = img->obj_table[idx]) != NULL && obj->id != id)
+		idx = (idx + 1) & (img->obj_table_size - 1);
+	return obj;
+}
+
+/* add an object to the table, NULL if out of memory */
+yaffs_object *yaffs_new_object(yaffs_image *img, unsigned id,
+                               yaffs_object *parent, yaffs_ObjectType type,
+                               const char *name) {
+	yaffs_object *obj;
+
+	obj = arena_alloc(img, offsetof(yaffs_object, name) + strlen(name) + 1);
+	if (obj == NULL)
+		return NULL;
+	obj->id = id;
+	obj->type = type;
+	obj->parent = parent;
+	if (type == YAFFS_OBJECT_TYPE_DIRECTORY && parent != NULL) {
+		obj->prev_dir_id = img->last_dir_id;
+		img->last_dir_id = id;
+	} else
+		obj->prev_dir_id = 0;
+	obj->hdr_pos = -1;
+	obj->file_size = 0;
+	obj->atime = obj->mtime = 0;
+	obj->mode = obj->uid = obj->gid = 0;
+	obj->chunks = NULL;
+	obj->chunk_count = 0;
+	obj->flags = 0;
+	strcpy(obj->name, name);
+	if (insert_object(img, obj) < 0)
+		return NULL;
+	return obj;
+}
+
+static int add_object(yaffs_image *img, yaffs_ObjectHeader *oh,
+                      yaffs_PackedTags2 *pt, yaffs_object **objp) {
+	yaffs_object *obj, *parent;
+
+	obj = yaffs_get_object(img, pt->t.objectId);
+	if (pt->t.objectId == YAFFS_OBJECTID_ROOT) {
+		if (obj == NULL)
+			return set_error(img, YAFFS_ERR_OBJECT, 0, "Missing root object");
+		if (oh->type != YAFFS_OBJECT_TYPE_DIRECTORY)
+			return set_error(img, YAFFS_ERR_OBJECT, 0,
+			                 "Root object must be directory");
+		if (img->last_dir_id == 0)
+			img->last_dir_id = YAFFS_OBJECTID_ROOT;
+	} else {
+		if (oh->type != YAFFS_OBJECT_TYPE_FILE &&
+		    oh->type != YAFFS_OBJECT_TYPE_DIRECTORY &&
+		    oh->type != YAFFS_OBJECT_TYPE_SYMLINK &&
+		    oh->type != YAFFS_OBJECT_TYPE_HARDLINK &&
+		    oh->type != YAFFS_OBJECT_TYPE_SPECIAL &&
+		    oh->type != YAFFS_OBJECT_TYPE_UNKNOWN)
+			return set_error(img, YAFFS_ERR_OBJECT, 0,
+			                 "Illegal type %d in object %u (%s)",
+			                 oh->type, pt->t.objectId, oh->name);
+		if (oh->name[0] == '\0' || strchr(oh->name, '/') != NULL ||
+		    strcmp(oh->name, ".") == 0 || strcmp(oh->name, "..") == 0)
+			return set_error(img, YAFFS_ERR_OBJECT, 0,
+			                 "Illegal file name %s in object %u",
+			                 oh->name, pt->t.objectId);
+		if (obj != NULL)
+			return set_error(img, YAFFS_ERR_OBJECT, 0,
+			                 "Duplicate objectId %u", pt->t.objectId);
+		parent = yaffs_get_object(img, oh->parentObjectId);
+		if (parent == NULL)
+			return set_error(img, YAFFS_ERR_OBJECT, 0,
+			                 "Invalid parentObjectId %u in object %u (%s)",
+			                 oh->parentObjectId, pt->t.objectId, oh->name);
+		if (parent->type != YAFFS_OBJECT_TYPE_DIRECTORY)
+			return set_error(img, YAFFS_ERR_OBJECT, ENOTDIR,
+			                 "File %s can't be created in %s",
+			                 oh->name, yaffs_path(parent));
+		obj = yaffs_new_object(img, pt->t.objectId, parent, oh->type,
+		                       oh->name);
+		if (obj == NULL)
+			return set_error(img, YAFFS_ERR_NOMEM, 0, NULL);
+	}
+
+	obj->atime = oh->yst_atime;
+	obj->mtime = oh->yst_mtime;
+	obj->mode  = oh->yst_mode;
+	obj->uid   = oh->yst_uid;
+	obj->gid   = oh->yst_gid;
+
+	*objp = obj;
+	return 0;
+}
+
+/* sleep until the ring index *idx differs from val */
+static void pipe_wait(struct yaffs_pipe *pipe, atomic_uint *idx, unsigned val) {
+	pthread_mutex_lock(&pipe->lock);
+	atomic_fetch_add(&pipe->waiting, 1);
+	while (atomic_load(idx) == val && !atomic_load(&pipe->stop))
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	atomic_fetch_sub(&pipe->waiting, 1);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+static void pipe_advance(struct yaffs_pipe *pipe, atomic_uint *idx) {
+	atomic_fetch_add(idx, 1);
+	if (atomic_load(&pipe->waiting) > 0) {
+		pthread_mutex_lock(&pipe->lock);
+		pthread_cond_broadcast(&pipe->cond);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+}
+
+static void *pipe_reader(void *arg) {
+	struct yaffs_pipe *pipe = arg;
+	struct t_pipe_block *blk;
+	unsigned head;
+	ssize_t s;
+
+	for (head = 0; ; head++) {
+		while (head - atomic_load(&pipe->tail) >= PIPE_BLOCKS &&
+		       !atomic_load(&pipe->stop))
+			pipe_wait(pipe, &pipe->tail, head - PIPE_BLOCKS);
+		if (atomic_load(&pipe->stop))
+			break;
+		blk = &pipe->blk[head % PIPE_BLOCKS];
+		blk->calls = 0;
+		s = xread(pipe->fd, blk->data, pipe->block_size, &blk->calls);
+		blk->err = s < 0 ? errno : 0;
+		blk->len = s < 0 ? 0 : s;
+		pipe_advance(pipe, &pipe->head);
+		if (blk->len < pipe->block_size)	/* end of image or error */
+			break;
+	}
+	return NULL;
+}
+
+static int start_reader(yaffs_image *img) {
+	struct yaffs_pipe *pipe;
+	int i;
+
+	if ((pipe = calloc(1, sizeof(*pipe))) == NULL)
+		return set_error(img, YAFFS_ERR_NOMEM, 0, "Malloc read buffer failed.");
+	pipe->block_size = img->buf_size / PIPE_BLOCKS;
+	if (pipe->block_size < YAFFS_DETECT_SIZE)
+		pipe->block_size = YAFFS_DETECT_SIZE;
+	pipe->mem = malloc(PIPE_BLOCKS * (YAFFS_DETECT_SIZE + pipe->block_size));
+	if (pipe->mem == NULL) {
+		free(pipe);
+		return set_error(img, YAFFS_ERR_NOMEM, 0, "Malloc read buffer failed.");
+	}
+	for (i = 0; i < PIPE_BLOCKS; i++)
+		pipe->blk[i].data = pipe->mem + YAFFS_DETECT_SIZE +
+		                    i * (YAFFS_DETECT_SIZE + pipe->block_size);
+	pipe->fd = img->fd;
+	atomic_init(&pipe->head, 0);
+	atomic_init(&pipe->tail, 0);
+	atomic_init(&pipe->waiting, 0);
+	atomic_init(&pipe->stop, 0);
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+
+	if ((errno = pthread_create(&pipe->tid, NULL, pipe_reader, pipe)) != 0) {
+		free(pipe->mem);
+		free(pipe);
+		return set_error(img, YAFFS_ERR_NOMEM, errno, "Can't create thread");
+	}
+	img->pipe = pipe;
+	img->buffer = NULL;
+	img->buf_len = img->buf_idx = 0;
+	return 0;
+}
+
+/*
+ * stop_reader - a reader thread, which waits for free blocks, stops
+ * immediately, one blocked in read() after that returns
+ */
+static void stop_reader(yaffs_image *img) {
+	struct yaffs_pipe *pipe = img->pipe;
+
+	pthread_mutex_lock(&pipe->lock);
+	atomic_store(&pipe->stop, 1);
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+	pthread_join(pipe->tid, NULL);
+	pthread_mutex_destroy(&pipe->lock);
+	pthread_cond_destroy(&pipe->cond);
+	free(pipe->mem);
+	free(pipe);
+	img->pipe = NULL;
+	img->buffer = NULL;
+}
+
+/* switch to the next blocks of the reader thread, until len bytes are available */
+static int pipe_fill(yaffs_image *img, size_t len) {
+	struct yaffs_pipe *pipe = img->pipe;
+	struct t_pipe_block *blk;
+	unsigned next;
+	size_t rest;
+
+	while (img->buf_len - img->buf_idx < len && !pipe->eof) {
+		next = atomic_load(&pipe->tail) + pipe->has_block;
+		while (atomic_load(&pipe->head) == next)
+			pipe_wait(pipe, &pipe->head, next);
+		blk = &pipe->blk[next % PIPE_BLOCKS];
+		if (blk->err != 0)
+			return set_error(img, YAFFS_ERR_IO, blk->err, NULL);
+		img->stats.read_calls += blk->calls;
+		img->stats.bytes_read += blk->len;
+
+		rest = img->buf_len - img->buf_idx;	/* carry rest of current block */
+		if (rest > 0)
+			memcpy(blk->data - rest, img->buffer + img->buf_idx, rest);
+		img->buffer  = blk->data - rest;
+		img->buf_idx = 0;
+		img->buf_len = rest + blk->len;
+		if (blk->len < pipe->block_size)
+			pipe->eof = 1;
+
+		if (pipe->has_block)		/* release previous block */
+			pipe_advance(pipe, &pipe->tail);
+		pipe->has_block = 1;
+	}
+	return 0;
+}
+
+/*
+ * fill_buffer - make sure, that at least len bytes are in the read
+ * buffer (unless the image ends).
+ * The unread rest is moved to the buffer start, so buffered chunks stay
+ * contiguous, but chunk views are only valid until the next refill.
+ */
+static int fill_buffer(yaffs_image *img, size_t len) {
+	ssize_t s;
+
+	if (img->buf_len - img->buf_idx >= len)
+		return 0;
+	if (img->refill_hook != NULL)		/* chunk views get invalid */
+		img->refill_hook();
+	if (img->pipe != NULL)
+		return pipe_fill(img, len);
+
+	if (img->buf_idx > 0) {
+		memmove(img->buffer, img->buffer + img->buf_idx,
+		        img->buf_len - img->buf_idx);
+		img->buf_len -= img->buf_idx;
+		img->buf_idx = 0;
+	}
+	s = xread(img->fd, img->buffer + img->buf_len,
+	          img->buf_size - img->buf_len, &img->stats.read_calls);
+	if (s < 0)
+		return set_error(img, YAFFS_ERR_IO, errno, NULL);
+	img->buf_len += s;
+	img->stats.bytes_read += s;
+	return 0;
+}
+
+/*
+ * find_hole - find the next hole of a sparse image file at or after pos.
+ * Holes read as zero bytes, which are never valid chunks (erased flash
+ * is 0xff), so yaffs_read_chunk() skips the chunks inside of them.
+ */
+static void find_hole(yaffs_image *img, off_t pos) {
+	img->hole_start = img->hole_end = NO_HOLE;
+#ifdef SEEK_HOLE
+	off_t cur, start, end;
+
+	if (pos >= img->size || (cur = lseek(img->fd, 0, SEEK_CUR)) < 0)
+		return;
+	start = lseek(img->fd, pos, SEEK_HOLE);
+	if (start >= 0 && start < img->size) {	/* EOF is no hole */
+		end = lseek(img->fd, start, SEEK_DATA);
+		img->hole_start = start;
+		img->hole_end = end >= 0 ? end : img->size;
+		img->stats.seek_calls++;
+	}
+	lseek(img->fd, cur, SEEK_SET);
+	img->stats.seek_calls += 3;
+#else
+	(void)pos;
+#endif
+}
+
+/* skip the chunks, that are completely inside of holes */
+static int skip_holes(yaffs_image *img) {
+	off_t len, first, last;
+	int ret;
+
+	len = img->chunk_size + img->spare_size;
+	while ((img->chunk_no + 1) * len > img->hole_start) {
+		first = (img->hole_start + len - 1) / len;
+		last = img->hole_end / len;
+		if (img->chunk_no < first)	/* chunk partly in the hole */
+			return 0;
+		if (img->chunk_no < last &&
+		    (ret = yaffs_skip_chunks(img, last - img->chunk_no)) < 0)
+			return ret;
+		find_hole(img, img->hole_end);
+	}
+	return 0;
+}
+
+/*
+ * map_image - map a regular image file into memory, so that chunk_data
+ * and spare_data can point directly into it. Non-seekable inputs
+ * (or a failing mmap) keep using the buffered read path.
+ * Also determines, if the image file is seekable.
+ */
+static void map_image(yaffs_image *img) {
+	struct stat st;
+	void *map;
+
+	if (fstat(img->fd, &st) < 0)
+		return;
+	if (S_ISREG(st.st_mode) && lseek(img->fd, 0, SEEK_CUR) >= 0) {
+		img->seekable = 1;
+		img->size = st.st_size;
+		find_hole(img, 0);
+	}
+	if (!img->seekable ||
+	    st.st_size <= 0 || (off_t)(size_t)st.st_size != st.st_size)
+		return;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	img->map = map;
+	img->pos = 0;
+}
+
+/*
+ * yaffs_open - create the handle of an image, which is read from fd.
+ * Regular files are mapped into memory, if possible; otherwise they are
+ * read through a buffer of buf_size bytes (0 for the default), which is
+ * filled by a reader thread for non-seekable inputs.
+ * The layout has to be set or probed before reading chunks.
+ */
+int yaffs_open(yaffs_image **imgp, int fd, size_t buf_size) {
+	yaffs_image *img;
+	yaffs_object *root;
+	int ret;
+
+	pthread_once(&all_ff_once, all_ff_select);
+	*imgp = NULL;
+	if ((img = calloc(1, sizeof(*img))) == NULL)
+		return -YAFFS_ERR_NOMEM;
+	img->fd = fd;
+	img->hole_start = img->hole_end = NO_HOLE;
+	img->buf_size = buf_size != 0 ? buf_size : YAFFS_BUF_SIZE;
+	if (img->buf_size < YAFFS_DETECT_SIZE)
+		img->buf_size = YAFFS_DETECT_SIZE;
+	img->chunk_size = yaffs_layouts[0].chunk_size;
+	img->spare_size = yaffs_layouts[0].spare_size;
+
+	map_image(img);
+	if (img->map == NULL && !img->seekable)
+		ret = start_reader(img);
+	else if ((img->buffer = malloc(img->buf_size)) == NULL)
+		ret = -YAFFS_ERR_NOMEM;
+	else
+		ret = 0;
+
+	if (ret == 0) {
+		root = yaffs_new_object(img, YAFFS_OBJECTID_ROOT, NULL,
+		                        YAFFS_OBJECT_TYPE_DIRECTORY, ".");
+		if (root == NULL)
+			ret = -YAFFS_ERR_NOMEM;
+	}
+	if (ret < 0) {
+		yaffs_close(img);
+		return ret;
+	}
+	*imgp = img;
+	return 0;
+}
+
+/* free all resources of an image, the file descriptor stays open */
+void yaffs_close(yaffs_image *img) {
+	if (img == NULL)
+		return;
+	if (img->pipe != NULL)
+		stop_reader(img);
+	else
+		free(img->buffer);
+	if (img->map != NULL)
+		munmap(img->map, img->size);
+	free(img->obj_table);
+	free(img->chunk_map);
+	free(img->scan_list);
+	arena_free(img);
+	free(img);
+}
+
+int yaffs_set_layout(yaffs_image *img, int chunk_size, int spare_size,
+                     int block_chunks) {
+	if (chunk_size < (int)sizeof(yaffs_ObjectHeader) ||
+	    chunk_size > YAFFS_MAX_CHUNK_SIZE ||
+	    spare_size < (int)sizeof(yaffs_PackedTags2TagsPart) ||
+	    spare_size > YAFFS_MAX_SPARE_SIZE || block_chunks < 0)
+		return set_error(img, YAFFS_ERR_LAYOUT, 0, NULL);
+	img->chunk_size = chunk_size;
+	img->spare_size = spare_size;
+	img->block_chunks = block_chunks;
+	return 0;
+}
+
+/*
+ * Layout detection: the chunk and spare sizes of real devices are tried
+ * on sample windows spread over the image. For each candidate the tags
+ * of the chunks in a window are scored: plausible object headers and
+ * data chunks count for it, a data chunk continuing the previous chunk
+ * of the same object counts more, implausible tags count against it,
+ * erased and zero filled chunks (holes of sparse images) are neutral.
+ * The candidate with the best total wins. Equal totals (e.g. a single
+ * chunk, whose tags are at the same position for all spare sizes) are
+ * decided by the chunks with a valid ECC of the packed tags in the
+ * spare area, then by the fewest invalid ones, then by the 0xff bytes
+ * padding the rest of the spare area, like mkyaffs2image does; if that
+ * doesn't decide either, the layout is ambiguous.
+ * Erase blocks get their own sequence number, so the gcd of the chunk
+ * numbers where it changes gives the block size of used partitions.
+ */
+static const int probe_chunk_sizes[] = { 512, 1024, 2048, 4096, 8192, 16384 };
+static const int probe_spare_sizes[] =
+	{ 16, 32, 64, 128, 218, 224, 256, 436, 448, 512, 640, 744, 1024, 1280 };
+
+#define PROBE_CHUNKS	(sizeof(probe_chunk_sizes) / sizeof(int))
+#define PROBE_SPARES	(sizeof(probe_spare_sizes) / sizeof(int))
+
+struct probe {
+	int      chunk_size;
+	int      spare_size;
+	long     score;
+	unsigned seq_changes;		/* chunks with a new sequence number */
+	off_t    block_gcd;		/* gcd of their chunk numbers */
+	unsigned ecc_ok;		/* tags with valid ECC */
+	unsigned ecc_bad;		/* tags with invalid ECC */
+	unsigned pad_ok;		/* 0xff padding after valid ones */
+};
+
+static off_t gcd(off_t a, off_t b) {
+	off_t t;
+
+	while (b != 0) {
+		t = a % b; a = b; b = t;
+	}
+	return a;
+}
+
+/* "other" ECC of yaffs_ecc.c, as used for the packed tags */
+static void tags_ecc(const unsigned char *data, unsigned len, yaffs_ECCOther *ecc) {
+	unsigned char col_parity, b;
+	unsigned line_parity, line_parity_prime, i;
+	int bit, parity, cp[6];
+
+	col_parity = 0;
+	line_parity = line_parity_prime = 0;
+	for (i = 0; i < len; i++) {
+		/* column parities cp0..cp5 of the byte and its parity */
+		memset(cp, 0, sizeof(cp));
+		parity = 0;
+		for (bit = 0; bit < 8; bit++) {
+			if (!(data[i] & (1 << bit)))
+				continue;
+			parity ^= 1;
+			cp[(bit & 1) ? 1 : 0] ^= 1;
+			cp[(bit & 2) ? 3 : 2] ^= 1;
+			cp[(bit & 4) ? 5 : 4] ^= 1;
+		}
+		b = parity | cp[0] << 2 | cp[1] << 3 | cp[2] << 4 |
+		    cp[3] << 5 | cp[4] << 6 | cp[5] << 7;
+		col_parity ^= b;
+		if (parity) {
+			line_parity ^= i;
+			line_parity_prime ^= ~i;
+		}
+	}
+	ecc->colParity = (col_parity >> 2) & 0x3f;
+	ecc->lineParity = line_parity;
+	ecc->lineParityPrime = line_parity_prime;
+}
+
+/* tie-break of a plausible chunk: ECC of its tags and the padding */
+static void probe_spare(struct probe *pr, const unsigned char *spare) {
+	yaffs_PackedTags2 pt;
+	yaffs_ECCOther ecc;
+	int i;
+
+	if (pr->spare_size < (int)sizeof(pt))
+		return;
+	memcpy(&pt, spare, sizeof(pt));
+	tags_ecc((const unsigned char *)&pt.t, sizeof(pt.t), &ecc);
+	if (ecc.colParity != pt.ecc.colParity ||
+	    ecc.lineParity != pt.ecc.lineParity ||
+	    ecc.lineParityPrime != pt.ecc.lineParityPrime) {
+		pr->ecc_bad++;
+		return;
+	}
+	pr->ecc_ok++;
+	for (i = sizeof(pt); i < pr->spare_size && spare[i] == 0xff; i++);
+	if (i == pr->spare_size)
+		pr->pad_ok += pr->spare_size - sizeof(pt);
+}
+
+/* score a layout on the window win of win_len bytes at image offset start */
+static void probe_window(struct probe *pr, const unsigned char *win,
+                         off_t start, size_t win_len) {
+	yaffs_PackedTags2TagsPart t, prev;
+	yaffs_ObjectType type;
+	const unsigned char *chunk;
+	off_t len, k;
+	__u32 obj;
+	int have_prev;
+
+	len = pr->chunk_size + pr->spare_size;
+	memset(&prev, 0, sizeof(prev));
+	have_prev = 0;
+	for (k = (start + len - 1) / len; (k + 1) * len <= start + (off_t)win_len; k++) {
+		chunk = win + (k * len - start);
+		memcpy(&t, chunk + pr->chunk_size, sizeof(t));
+		if ((t.sequenceNumber == 0xffffffff && t.objectId == 0xffffffff &&
+		     t.chunkId == 0xffffffff && t.byteCount == 0xffffffff) ||
+		    (t.sequenceNumber == 0 && t.objectId == 0 &&
+		     t.chunkId == 0 && t.byteCount == 0)) {
+			have_prev = 0;		/* erased, hole or zero padding */
+			continue;
+		}
+		if (t.sequenceNumber < SEQ_LOWEST || t.sequenceNumber > SEQ_HIGHEST) {
+			pr->score -= 2;
+			have_prev = 0;
+			continue;
+		}
+		obj = t.objectId;
+		if ((t.chunkId == 0 && t.byteCount == 0xffff) ||
+		    (t.chunkId & EXTRA_HEADER_INFO_FLAG)) {	/* object header */
+			if (t.chunkId & EXTRA_HEADER_INFO_FLAG)
+				obj &= ~EXTRA_OBJECT_TYPE_MASK;
+			memcpy(&type, chunk, sizeof(type));
+			if (type >= YAFFS_OBJECT_TYPE_FILE &&
+			    type <= YAFFS_OBJECT_TYPE_SPECIAL)
+				pr->score += 2;
+			else
+				pr->score -= 2;
+			t.chunkId = 0;
+		} else if (t.chunkId > 0 && t.chunkId < EXTRA_HEADER_INFO_FLAG &&
+		           t.byteCount <= (__u32)pr->chunk_size) {
+			pr->score += t.byteCount == (__u32)pr->chunk_size ? 2 : 1;
+			if (have_prev && prev.objectId == obj &&
+			    prev.chunkId + 1 == t.chunkId)
+				pr->score += 2;
+		} else {
+			pr->score -= 2;
+			have_prev = 0;
+			continue;
+		}
+		probe_spare(pr, chunk + pr->chunk_size);
+		if (have_prev && prev.sequenceNumber != t.sequenceNumber) {
+			pr->seq_changes++;
+			pr->block_gcd = gcd(k, pr->block_gcd);
+		}
+		t.objectId = obj;
+		prev = t;
+		have_prev = 1;
+	}
+}
+
+/* compare two candidates, > 0 if a is better */
+static int probe_cmp(const struct probe *a, const struct probe *b) {
+	if (a->score != b->score)
+		return a->score > b->score ? 1 : -1;
+	if (a->ecc_ok != b->ecc_ok)
+		return a->ecc_ok > b->ecc_ok ? 1 : -1;
+	if (a->ecc_bad != b->ecc_bad)
+		return a->ecc_bad < b->ecc_bad ? 1 : -1;
+	if (a->pad_ok != b->pad_ok)
+		return a->pad_ok > b->pad_ok ? 1 : -1;
+	return 0;
+}
+
+/*
+ * yaffs_probe_layout - detect the layout, chunk_size and spare_size
+ * are fixed if not 0. Seekable images are sampled at PROBE_WINDOWS
+ * positions (read with pread, if not mapped), otherwise the start of
+ * the image in the read buffer is used. No chunks are consumed.
+ */
+int yaffs_probe_layout(yaffs_image *img, int chunk_size, int spare_size) {
+	struct probe probes[PROBE_CHUNKS * PROBE_SPARES], *pr, *best;
+	unsigned char *win, *tmp;
+	off_t start, win_len;
+	int i, j, n, count, windows, ret;
+
+	count = 0;
+	for (i = 0; i < (int)PROBE_CHUNKS; i++)
+		for (j = 0; j < (int)PROBE_SPARES; j++) {
+			if ((chunk_size != 0 && i > 0) || (spare_size != 0 && j > 0))
+				continue;
+			pr = &probes[count++];
+			memset(pr, 0, sizeof(*pr));
+			pr->chunk_size = chunk_size != 0 ? chunk_size : probe_chunk_sizes[i];
+			pr->spare_size = spare_size != 0 ? spare_size : probe_spare_sizes[j];
+		}
+
+	tmp = NULL;
+	if (img->seekable && img->size > 0) {
+		windows = img->size > PROBE_WINDOWS * PROBE_WINDOW_SIZE ? PROBE_WINDOWS : 1;
+		win_len = windows > 1 ? PROBE_WINDOW_SIZE : img->size;
+		if (img->map == NULL && (tmp = malloc(win_len)) == NULL)
+			return set_error(img, YAFFS_ERR_NOMEM, 0, NULL);
+	} else {
+		if ((ret = fill_buffer(img, YAFFS_DETECT_SIZE)) < 0)
+			return ret;
+		windows = 1;
+		win_len = img->buf_len - img->buf_idx;
+	}
+
+	for (n = 0; n < windows; n++) {
+		start = windows > 1 ? n * ((img->size - win_len) / (windows - 1)) : 0;
+		if (img->map != NULL)
+			win = img->map + start;
+		else if (tmp != NULL) {
+			img->stats.read_calls++;
+			if (pread(img->fd, tmp, win_len, start) != win_len) {
+				free(tmp);
+				return set_error(img, YAFFS_ERR_IO, errno, NULL);
+			}
+			img->stats.bytes_read += win_len;
+			win = tmp;
+		} else
+			win = img->buffer + img->buf_idx;
+		for (i = 0; i < count; i++)
+			probe_window(&probes[i], win, start, win_len);
+	}
+	free(tmp);
+
+	best = &probes[0];
+	for (i = 1; i < count; i++)
+		if (probe_cmp(&probes[i], best) > 0)
+			best = &probes[i];
+	if (best->score < 2)			/* no plausible tags */
+		return set_error(img, YAFFS_ERR_NOT_YAFFS, 0, NULL);
+	for (i = 0; i < count; i++)
+		if (&probes[i] != best && probe_cmp(&probes[i], best) == 0)
+			return set_error(img, YAFFS_ERR_LAYOUT, 0,
+			                 "Ambiguous layout (chunk size %d, spare size %d "
+			                 "or chunk size %d, spare size %d)",
+			                 best->chunk_size, best->spare_size,
+			                 probes[i].chunk_size, probes[i].spare_size);
+	if ((ret = yaffs_set_layout(img, best->chunk_size, best->spare_size, 0)) < 0)
+		return ret;
+
+	/* block size: enough changes, a power of 2 of at least 16 chunks */
+	if (best->seq_changes >= 8 && best->block_gcd >= 16 &&
+	    best->block_gcd <= 65536 &&
+	    (best->block_gcd & (best->block_gcd - 1)) == 0)
+		img->block_chunks = best->block_gcd;
+	return 0;
+}
+
+/* check, if the next chunk can be read without invalidating chunk views */
+int yaffs_chunk_buffered(yaffs_image *img) {
+	return img->map != NULL ||
+	       img->buf_len - img->buf_idx >= img->chunk_size + img->spare_size;
+}
+
+/* read the next chunk, returns 0 at the end of the image */
+int yaffs_read_chunk(yaffs_image *img) {
+	size_t len;
+	int ret;
+
+	if ((img->chunk_no + 1) * (off_t)(img->chunk_size + img->spare_size) >
+	    img->hole_start && (ret = skip_holes(img)) < 0)
+		return ret;
+	img->chunk_no++;
+	len = img->chunk_size + img->spare_size;
+
+	if (img->map != NULL) {			/* point into mapped image */
+		if (img->pos >= img->size)
+			return 0;
+		if (img->size - img->pos < len)	/* partial chunk */
+			return set_error(img, YAFFS_ERR_BROKEN, 0, NULL);
+		img->chunk_data = img->map + img->pos;
+		img->spare_data = img->chunk_data + img->chunk_size;
+		img->pos += len;
+		img->stats.chunks_read++;
+		return 1;
+	}
+
+	if ((ret = fill_buffer(img, len)) < 0)
+		return ret;
+	if (img->buf_len == img->buf_idx)	/* end of image */
+		return 0;
+	if (img->buf_len - img->buf_idx < len)	/* partial chunk */
+		return set_error(img, YAFFS_ERR_BROKEN, 0, NULL);
+
+	img->chunk_data = img->buffer + img->buf_idx;	/* point into read buffer */
+	img->spare_data = img->chunk_data + img->chunk_size;
+	img->buf_idx += len;
+	img->stats.chunks_read++;
+	return 1;
+}
+
+/*
+ * yaffs_skip_chunks - skip over count chunks without reading them,
+ * only used for seekable image files
+ */
+int yaffs_skip_chunks(yaffs_image *img, int count) {
+	off_t len, pos, s;
+
+	len = (off_t)count * (img->chunk_size + img->spare_size);
+	img->chunk_no += count;
+	img->stats.chunks_skipped += count;
+
+	if (img->map != NULL) {
+		if (img->size - img->pos < len)
+			return set_error(img, YAFFS_ERR_BROKEN, 0, NULL);
+		img->pos += len;
+		return 0;
+	}
+
+	if (img->buf_len > img->buf_idx) {	/* skip buffered data first */
+		s = img->buf_len - img->buf_idx;
+		if (s > len) s = len;
+		img->buf_idx += s; len -= s;
+	}
+	if (len == 0)
+		return 0;
+
+	img->stats.seek_calls++;
+	if ((pos = lseek(img->fd, len, SEEK_CUR)) < 0)
+		return set_error(img, YAFFS_ERR_IO, errno, "Seek image file");
+	if (img->size != 0 && pos > img->size)
+		return set_error(img, YAFFS_ERR_BROKEN, 0, NULL);
+	return 0;
+}
+
+/*
+ * skip_erased - skip the run of erased chunks (spare area all 0xff)
+ * following an erased chunk, without handing them to the callers
+ */
+static int skip_erased(yaffs_image *img) {
+	size_t len;
+	unsigned char *chunk;
+	int ret;
+
+	len = img->chunk_size + img->spare_size;
+	for (;;) {
+		if (img->map != NULL) {
+			if (img->size - img->pos < len)
+				return 0;
+			chunk = img->map + img->pos;
+		} else {
+			if ((ret = fill_buffer(img, len)) < 0)
+				return ret;
+			if (img->buf_len - img->buf_idx < len)
+				return 0;
+			chunk = img->buffer + img->buf_idx;
+		}
+		if (!all_ff(chunk + img->chunk_size, img->spare_size))
+			return 0;
+		if (img->map != NULL)
+			img->pos += len;
+		else
+			img->buf_idx += len;
+		img->chunk_no++;
+		img->stats.chunks_read++;
+		img->stats.chunks_erased++;
+	}
+}
+
+/*
+ * yaffs_scan_header - common checks of the current chunk, which should
+ * contain an object header. Returns 1 and the object, 0 if the chunk is
+ * skipped (with a warning, if it's invalid) or an error.
+ */
+int yaffs_scan_header(yaffs_image *img, yaffs_object **objp) {
+	yaffs_ObjectHeader *oh;
+	yaffs_PackedTags2 *pt;
+	char msg[80];
+	int ret;
+
+	oh = (yaffs_ObjectHeader *)img->chunk_data;
+	pt = (yaffs_PackedTags2 *)img->spare_data;
+
+	if (pt->t.byteCount == 0xffffffff) {	/* empty object */
+		img->stats.chunks_erased++;
+		return skip_erased(img);
+	}
+	else if (pt->t.byteCount != 0xffff) {	/* not a new object */
+		if (img->warn != NULL) {
+			snprintf(msg, sizeof(msg),
+			         "Invalid header at chunk #%d, skipping...",
+			         img->chunk_no);
+			img->warn(img, msg);
+		}
+		if (++img->warn_count >= YAFFS_MAX_WARN)
+			return set_error(img, YAFFS_ERR_WARNINGS, 0, NULL);
+		return 0;
+	}
+
+	if ((ret = add_object(img, oh, pt, objp)) < 0)
+		return ret;
+	(*objp)->hdr_pos = (off_t)(img->chunk_no - 1) *
+	                   (img->chunk_size + img->spare_size);
+	if (oh->type == YAFFS_OBJECT_TYPE_FILE)
+		(*objp)->file_size = oh->fileSize;
+	return 1;
+}
+
+/* skip over the unread data chunks of the current file */
+int yaffs_skip_data(yaffs_image *img) {
+	yaffs_PackedTags2 *pt;
+	int remain, ret;
+
+	remain = img->data_remain;
+	img->data_remain = 0;
+	if (img->seekable && remain > 0)
+		return yaffs_skip_chunks(img, (remain - 1) / img->chunk_size + 1);
+	while (remain > 0) {
+		if ((ret = yaffs_read_chunk(img)) <= 0)
+			return ret < 0 ? ret : set_error(img, YAFFS_ERR_BROKEN, 0, NULL);
+		pt = (yaffs_PackedTags2 *)img->spare_data;
+		remain -= pt->t.byteCount;
+	}
+	return 0;
+}
+
+/* append an object to the list of scanned objects */
+static int scan_list_add(yaffs_image *img, yaffs_object *obj) {
+	yaffs_object **list;
+	unsigned n;
+
+	if (img->scan_count >= img->scan_alloc) {
+		n = img->scan_alloc ? 2 * img->scan_alloc : 1024;
+		if ((list = realloc(img->scan_list, n * sizeof(*list))) == NULL)
+			return set_error(img, YAFFS_ERR_NOMEM, 0, "Malloc object list failed.");
+		img->scan_list = list;
+		img->scan_alloc = n;
+	}
+	img->scan_list[img->scan_count++] = obj;
+	return 0;
+}
+
+/* next object of the full or chunk map scan, the header is read again */
+static int next_scanned(yaffs_image *img, yaffs_object **objp,
+                        yaffs_ObjectHeader **ohp) {
+	if (img->scan_next >= img->scan_count)
+		return 0;
+	*objp = img->scan_list[img->scan_next++];
+	if ((*ohp = yaffs_read_header(img, *objp, &img->hdr)) == NULL)
+		return -YAFFS_ERR_IO;
+	return 1;
+}
+
+/*
+ * yaffs_next_object - iterate over the objects in image order
+ * (after a full scan: the current objects, parents first).
+ * Returns 1 with the object and its header, 0 at the end of the image
+ * or an error. The data of the previous file is skipped, as far as it
+ * wasn't read with yaffs_next_data(). The header stays valid until the
+ * next call.
+ */
+int yaffs_next_object(yaffs_image *img, yaffs_object **objp,
+                      yaffs_ObjectHeader **ohp) {
+	int ret;
+
+	if (img->chunk_maps)
+		return next_scanned(img, objp, ohp);
+	if ((ret = yaffs_skip_data(img)) < 0)
+		return ret;
+	for (;;) {
+		if ((ret = yaffs_read_chunk(img)) <= 0)
+			return ret;
+		if ((ret = yaffs_scan_header(img, objp)) < 0)
+			return ret;
+		if (ret > 0)
+			break;
+	}
+
+	/* a mapped header stays valid, a buffered one gets overwritten */
+	if (img->map != NULL)
+		*ohp = (yaffs_ObjectHeader *)img->chunk_data;
+	else {
+		img->hdr = *(yaffs_ObjectHeader *)img->chunk_data;
+		*ohp = &img->hdr;
+	}
+	if ((*ohp)->type == YAFFS_OBJECT_TYPE_FILE && (*ohp)->fileSize > 0)
+		img->data_remain = (*ohp)->fileSize;
+	return 1;
+}
+
+/*
+ * yaffs_next_data - next data chunk of the current file, returns 1 with
+ * a view of the data, 0 at the end of the file or an error. The view
+ * stays valid while yaffs_chunk_buffered() is true before the next read.
+ */
+int yaffs_next_data(yaffs_image *img, const unsigned char **datap, int *lenp) {
+	yaffs_PackedTags2 *pt;
+	int ret;
+
+	if (img->data_remain <= 0)
+		return 0;
+	if ((ret = yaffs_read_chunk(img)) <= 0) {
+		img->data_remain = 0;
+		return ret < 0 ? ret : set_error(img, YAFFS_ERR_BROKEN, 0, NULL);
+	}
+	pt = (yaffs_PackedTags2 *)img->spare_data;
+	*datap = img->chunk_data;
+	*lenp = img->data_remain < pt->t.byteCount ? img->data_remain
+	                                           : (int)pt->t.byteCount;
+	img->data_remain -= *lenp;
+	return 1;
+}
+
+/*
+ * yaffs_read_header - get the object header of an object at its image
+ * position (seekable images only), buf is used when the image isn't mapped.
+ * After a full scan the header is always copied into buf, with the file
+ * size found by the scan, or built from the attributes (lost+found).
+ */
+yaffs_ObjectHeader *yaffs_read_header(yaffs_image *img, yaffs_object *obj,
+                                      yaffs_ObjectHeader *buf) {
+	if (obj->hdr_pos < 0 && img->chunk_maps) {	/* lost+found */
+		memset(buf, 0, sizeof(*buf));
+		buf->type = obj->type;
+		buf->parentObjectId = obj->parent != NULL ? obj->parent->id : obj->id;
+		strncpy(buf->name, obj->name, YAFFS_MAX_NAME_LENGTH);
+		buf->yst_mode  = obj->mode;
+		buf->yst_uid   = obj->uid;
+		buf->yst_gid   = obj->gid;
+		buf->yst_atime = obj->atime;
+		buf->yst_mtime = obj->mtime;
+		return buf;
+	}
+	if (obj->hdr_pos < 0) {
+		set_error(img, YAFFS_ERR_OBJECT, 0, "Object %u has no header", obj->id);
+		return NULL;
+	}
+	if (img->map != NULL) {
+		if (!img->chunk_maps)
+			return (yaffs_ObjectHeader *)(img->map + obj->hdr_pos);
+		memcpy(buf, img->map + obj->hdr_pos, sizeof(*buf));
+	} else {
+		__atomic_add_fetch(&img->stats.read_calls, 1, __ATOMIC_RELAXED);
+		if (pread(img->fd, buf, sizeof(*buf), obj->hdr_pos) != sizeof(*buf)) {
+			set_error(img, YAFFS_ERR_IO, errno, NULL);
+			return NULL;
+		}
+	}
+	if (img->chunk_maps && buf->type == YAFFS_OBJECT_TYPE_FILE)
+		buf->fileSize = obj->file_size;
+	return buf;
+}
+
+/*
+ * Full scan (yaffs_full_scan) of a used flash partition: objects are
+ * rewritten, shrunk, renamed and deleted, and the chunks of a file are
+ * spread over the erase blocks. Erase blocks get increasing sequence
+ * numbers when they are allocated and are written from start to end,
+ * so sorting the chunks by sequenceNumber and position orders the
+ * erase blocks and all chunks by age, without knowing the block size.
+ *
+ * Like the yaffs2 kernel scan, the chunks are then processed from
+ * newest to oldest: the newest header of an object and the newest
+ * version of each (objectId, chunkId) win. Data chunks older than a
+ * header are discarded beyond the file size of that header, if it's the
+ * newest one or a shrink header. Deleted and unlinked objects, and
+ * objects shadowed by a rename over them, lose all older chunks.
+ *
+ * The bookkeeping uses packed arrays sorted with qsort(). During the
+ * scan that's 20 bytes per chunk of the image (only the used ones are
+ * touched), 16 bytes per object header and 48 bytes per object, and
+ * afterwards 16 bytes per valid data chunk.
+ */
+#define OBJECTID_LOSTNFOUND	    2
+#define OBJECTID_UNLINKED	    3
+#define OBJECTID_DELETED	    4
+
+struct scan_chunk {
+	__u32    seq;
+	__u32    chunk_no;		/* position in image, in chunks */
+	__u32    obj;			/* object id, then index in scan objects */
+	__u32    chunk_id;		/* 0 for headers and discarded chunks */
+	__u32    n_bytes;		/* headers: index in scan headers */
+};
+
+struct scan_header {
+	__u32    parent_id;
+	int      file_size;
+	int      shadows;
+	unsigned char type;
+	unsigned char is_shrink;
+};
+
+#define SO_SEEN			0x01	/* a newer chunk was processed */
+#define SO_VALID		0x02	/* newest header found */
+#define SO_DELETED		0x04
+#define SO_BUSY			0x08	/* creating its parents */
+
+struct scan_object {
+	__u32    id;
+	__u32    parent_id;
+	__u32    hdr_chunk;		/* newest header */
+	unsigned char type;
+	unsigned char state;
+	long long size;			/* file size */
+	long long shrink;		/* older data beyond this is invalid */
+	unsigned map_first;		/* data chunks in chunk map */
+	unsigned map_count;
+	yaffs_object *obj;
+};
+
+struct scan {
+	struct scan_chunk  *chunks;
+	unsigned            chunk_count;
+	struct scan_header *hdrs;
+	unsigned            hdr_count;
+	unsigned            hdr_alloc;
+	struct scan_object *objs;
+	unsigned            obj_count;
+	unsigned            scan_alloc;
+};
+
+/* by object, chunkId and newest first */
+static int cmp_scan_key(const void *a, const void *b) {
+	const struct scan_chunk *ca = a, *cb = b;
+
+	if (ca->obj != cb->obj)
+		return ca->obj < cb->obj ? -1 : 1;
+	if (ca->chunk_id != cb->chunk_id)
+		return ca->chunk_id < cb->chunk_id ? -1 : 1;
+	if (ca->seq != cb->seq)
+		return ca->seq > cb->seq ? -1 : 1;
+	return ca->chunk_no > cb->chunk_no ? -1 : 1;
+}
+
+/* newest first */
+static int cmp_scan_age(const void *a, const void *b) {
+	const struct scan_chunk *ca = a, *cb = b;
+
+	if (ca->seq != cb->seq)
+		return ca->seq > cb->seq ? -1 : 1;
+	return ca->chunk_no > cb->chunk_no ? -1 : 1;
+}
+
+static void scan_warn(yaffs_image *img, const char *format, ...) {
+	va_list varg;
+	char msg[160];
+
+	if (img->warn == NULL)
+		return;
+	va_start(varg, format);
+	vsnprintf(msg, sizeof(msg), format, varg);
+	va_end(varg);
+	img->warn(img, msg);
+}
+
+static struct scan_object *scan_find(struct scan *sc, __u32 id) {
+	unsigned lo, hi, mid;
+
+	lo = 0; hi = sc->obj_count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (sc->objs[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < sc->obj_count && sc->objs[lo].id == id ? &sc->objs[lo] : NULL;
+}
+
+/* first pass: read the tags of all chunks, keep the used ones */
+static int scan_read(yaffs_image *img, struct scan *sc) {
+	yaffs_PackedTags2 *pt;
+	yaffs_ObjectHeader *oh;
+	struct scan_chunk *c;
+	struct scan_header *h;
+	__u32 chunk_id;
+	unsigned beyond;
+	int n, ret;
+
+	sc->scan_alloc = img->size / (img->chunk_size + img->spare_size);
+	sc->chunks = malloc((sc->scan_alloc + 1) * sizeof(*sc->chunks));
+	if (sc->chunks == NULL)
+		return set_error(img, YAFFS_ERR_NOMEM, 0, "Malloc chunk table failed.");
+
+	beyond = 0;
+	while ((ret = yaffs_read_chunk(img)) > 0) {
+		pt = (yaffs_PackedTags2 *)img->spare_data;
+		if (pt->t.sequenceNumber == 0xffffffff) {
+			img->stats.chunks_erased++;
+			if (img->block_chunks > 0 &&
+			    (img->chunk_no - 1) % img->block_chunks == 0) {
+				/* like the kernel: erased first chunk, empty block */
+				n = sc->scan_alloc - img->chunk_no;
+				if (n > img->block_chunks - 1)
+					n = img->block_chunks - 1;
+				ret = yaffs_skip_chunks(img, n);
+			} else
+				ret = skip_erased(img);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+		if (pt->t.sequenceNumber < SEQ_LOWEST ||
+		    pt->t.sequenceNumber > SEQ_HIGHEST) {
+			img->stats.chunks_obsolete++;
+			continue;
+		}
+		if (sc->chunk_count >= sc->scan_alloc) {	/* image grew */
+			img->stats.chunks_obsolete++;
+			beyond++;
+			continue;
+		}
+		c = &sc->chunks[sc->chunk_count++];
+		c->seq = pt->t.sequenceNumber;
+		c->chunk_no = img->chunk_no - 1;
+		c->obj = pt->t.objectId;
+		chunk_id = pt->t.chunkId;
+		if (chunk_id == 0 || (chunk_id & EXTRA_HEADER_INFO_FLAG)) {
+			/* object header, the kernel packs the type into the id */
+			if (chunk_id & EXTRA_HEADER_INFO_FLAG)
+				c->obj &= ~EXTRA_OBJECT_TYPE_MASK;
+			oh = (yaffs_ObjectHeader *)img->chunk_data;
+			if (sc->hdr_count >= sc->hdr_alloc) {
+				n = sc->hdr_alloc ? 2 * sc->hdr_alloc : 1024;
+				if ((h = realloc(sc->hdrs, n * sizeof(*h))) == NULL)
+					return set_error(img, YAFFS_ERR_NOMEM, 0,
+					                 "Malloc header table failed.");
+				sc->hdrs = h;
+				sc->hdr_alloc = n;
+			}
+			h = &sc->hdrs[sc->hdr_count];
+			h->parent_id = oh->parentObjectId;
+			h->file_size = oh->fileSize;
+			h->shadows   = oh->shadowsObject;
+			h->type      = oh->type;
+			h->is_shrink = oh->isShrink != 0;
+			c->chunk_id = 0;
+			c->n_bytes = sc->hdr_count++;
+		} else {
+			c->chunk_id = chunk_id;
+			c->n_bytes = pt->t.byteCount;
+		}
+	}
+	if (beyond > 0)
+		scan_warn(img, "Image grew during the scan, %u chunks beyond "
+		          "its size skipped", beyond);
+	return ret;
+}
+
+/*
+ * sort by key: drop the older versions of data chunks and number the
+ * objects, c->obj becomes the index in the scan objects
+ */
+static int scan_objects(yaffs_image *img, struct scan *sc) {
+	struct scan_chunk *c, *prev;
+	struct scan_object *so;
+	unsigned i, n;
+
+	qsort(sc->chunks, sc->chunk_count, sizeof(*sc->chunks), cmp_scan_key);
+	for (i = n = 0; i < sc->chunk_count; i++)	/* count the objects */
+		if (i == 0 || sc->chunks[i].obj != sc->chunks[i-1].obj)
+			n++;
+	if ((sc->objs = malloc((n + 1) * sizeof(*sc->objs))) == NULL)
+		return set_error(img, YAFFS_ERR_NOMEM, 0, "Malloc object table failed.");
+
+	prev = NULL;
+	for (i = n = 0; i < sc->chunk_count; i++) {
+		c = &sc->chunks[i];
+		if (prev != NULL && c->chunk_id != 0 &&
+		    c->obj == prev->obj && c->chunk_id == prev->chunk_id) {
+			img->stats.chunks_obsolete++;	/* older version */
+			continue;
+		}
+		if (prev == NULL || c->obj != prev->obj) {
+			so = &sc->objs[sc->obj_count++];
+			memset(so, 0, sizeof(*so));
+			so->id = c->obj;
+			so->shrink = 0x7fffffffffffffffLL;
+		}
+		sc->chunks[n] = *c;
+		prev = &sc->chunks[n++];
+	}
+	sc->chunk_count = n;
+	for (i = n = 0; i < sc->chunk_count; i++) {
+		if (i > 0 && sc->chunks[i].obj != sc->objs[n].id)
+			n++;
+		sc->chunks[i].obj = n;
+	}
+	return 0;
+}
+
+/*
+ * second pass, newest chunk first: find the newest header of each
+ * object and discard the data chunks, that aren't valid any more
+ */
+static void scan_resolve(yaffs_image *img, struct scan *sc) {
+	struct scan_chunk *c;
+	struct scan_header *h;
+	struct scan_object *so, *shadowed;
+	long long base, size;
+	unsigned i;
+	int shrink;
+
+	qsort(sc->chunks, sc->chunk_count, sizeof(*sc->chunks), cmp_scan_age);
+	for (i = 0; i < sc->chunk_count; i++) {
+		c = &sc->chunks[i];
+		so = &sc->objs[c->obj];
+		so->state |= SO_SEEN;
+
+		if (c->chunk_id == 0) {			/* object header */
+			h = &sc->hdrs[c->n_bytes];
+			if (!(so->state & SO_VALID)) {	/* newest one */
+				so->state |= SO_VALID;
+				so->type = h->type;
+				so->parent_id = h->parent_id;
+				so->hdr_chunk = c->chunk_no;
+				if (h->parent_id == OBJECTID_UNLINKED ||
+				    h->parent_id == OBJECTID_DELETED)
+					so->state |= SO_DELETED;
+				/*
+				 * the shadowed object is gone, unless it has a newer
+				 * header (its id was reused). Newer data chunks alone
+				 * were written while it was still open.
+				 */
+				if (h->shadows > 0 && h->shadows != so->id &&
+				    (shadowed = scan_find(sc, h->shadows)) != NULL &&
+				    !(shadowed->state & SO_VALID))
+					shadowed->state |= SO_SEEN | SO_VALID | SO_DELETED;
+				if (h->type == YAFFS_OBJECT_TYPE_FILE) {
+					if (so->size < h->file_size)
+						so->size = h->file_size;
+					if (so->shrink > h->file_size)
+						so->shrink = h->file_size;
+				}
+				continue;
+			}
+			img->stats.chunks_obsolete++;
+			if (so->type != YAFFS_OBJECT_TYPE_FILE ||
+			    h->type != YAFFS_OBJECT_TYPE_FILE)
+				continue;
+			size = h->file_size;
+			shrink = h->is_shrink;
+			if (h->parent_id == OBJECTID_UNLINKED ||
+			    h->parent_id == OBJECTID_DELETED) {
+				size = 0;		/* deleted before */
+				shrink = 1;
+			}
+			if (shrink && so->shrink > size)
+				so->shrink = size;
+			continue;
+		}
+
+		base = (long long)(c->chunk_id - 1) * img->chunk_size;
+		if ((so->state & SO_DELETED) || base >= so->shrink ||
+		    c->n_bytes > img->chunk_size ||
+		    ((so->state & SO_VALID) && so->type != YAFFS_OBJECT_TYPE_FILE)) {
+			img->stats.chunks_obsolete++;
+			c->chunk_id = 0;		/* discarded */
+			continue;
+		}
+		/* data newer than the newest header extends the file */
+		if (!(so->state & SO_VALID) && so->size < base + c->n_bytes)
+			so->size = base + c->n_bytes;
+	}
+}
+
+/* build the chunk map of the valid data chunks, sorted by object and chunkId */
+static int scan_map(yaffs_image *img, struct scan *sc) {
+	struct scan_chunk *c;
+	struct scan_object *so;
+	unsigned i, n;
+
+	for (i = n = 0; i < sc->chunk_count; i++)
+		if (sc->chunks[i].chunk_id != 0)
+			sc->chunks[n++] = sc->chunks[i];
+	qsort(sc->chunks, n, sizeof(*sc->chunks), cmp_scan_key);
+
+	if ((img->chunk_map = malloc((n + 1) * sizeof(struct yaffs_chunk))) == NULL)
+		return set_error(img, YAFFS_ERR_NOMEM, 0, "Malloc chunk map failed.");
+	for (i = 0; i < n; i++) {
+		c = &sc->chunks[i];
+		so = &sc->objs[c->obj];
+		if (so->map_count == 0)
+			so->map_first = i;
+		so->map_count++;
+		img->chunk_map[i].chunk_id = c->chunk_id;
+		img->chunk_map[i].n_bytes  = c->n_bytes;
+		img->chunk_map[i].pos = (off_t)c->chunk_no *
+		                        (img->chunk_size + img->spare_size);
+	}
+	return 0;
+}
+
+/* read the newest header of a scan object */
+static yaffs_ObjectHeader *scan_header(yaffs_image *img, struct scan_object *so,
+                                       yaffs_object *tmp, yaffs_ObjectHeader *buf) {
+	tmp->id = so->id;
+	tmp->hdr_pos = (off_t)so->hdr_chunk * (img->chunk_size + img->spare_size);
+	tmp->file_size = so->size < 0x7fffffff ? so->size : 0x7fffffff;
+	return yaffs_read_header(img, tmp, buf);
+}
+
+static yaffs_object *scan_create(yaffs_image *img, struct scan *sc,
+                                 struct scan_object *so);
+
+/* lost+found, for objects without a valid parent */
+static yaffs_object *scan_lost_found(yaffs_image *img, struct scan *sc) {
+	struct scan_object *so;
+	yaffs_object *obj;
+
+	if ((obj = yaffs_get_object(img, OBJECTID_LOSTNFOUND)) != NULL)
+		return obj;
+	if ((so = scan_find(sc, OBJECTID_LOSTNFOUND)) != NULL &&
+	    (obj = scan_create(img, sc, so)) != NULL)
+		return obj;
+	obj = yaffs_new_object(img, OBJECTID_LOSTNFOUND,
+	                       yaffs_get_object(img, YAFFS_OBJECTID_ROOT),
+	                       YAFFS_OBJECT_TYPE_DIRECTORY, "lost+found");
+	if (obj == NULL)
+		return NULL;
+	obj->mode = S_IFDIR | 0700;
+	if (scan_list_add(img, obj) < 0)
+		return NULL;
+	return obj;
+}
+
+/* find or create the parent directory of a scan object */
+static yaffs_object *scan_parent(yaffs_image *img, struct scan *sc,
+                                 struct scan_object *so, const char *name) {
+	struct scan_object *pso;
+	yaffs_object *parent;
+
+	parent = NULL;
+	if (so->parent_id == YAFFS_OBJECTID_ROOT)
+		parent = yaffs_get_object(img, YAFFS_OBJECTID_ROOT);
+	else if ((pso = scan_find(sc, so->parent_id)) != NULL &&
+	         pso->type == YAFFS_OBJECT_TYPE_DIRECTORY)
+		parent = scan_create(img, sc, pso);
+	if (parent == NULL) {
+		scan_warn(img, "Object %u (%s) has no parent, moved to lost+found",
+		          so->id, name);
+		parent = scan_lost_found(img, sc);
+	}
+	return parent;
+}
+
+/*
+ * scan_create - create the object of a current header, after its
+ * parents. Returns NULL, if the object is invalid (or part of a loop
+ * of directories) or out of memory.
+ */
+static yaffs_object *scan_create(yaffs_image *img, struct scan *sc,
+                                 struct scan_object *so) {
+	yaffs_ObjectHeader oh_buf, *oh;
+	yaffs_object tmp, *obj, *parent;
+
+	if (so->obj != NULL)
+		return so->obj;
+	if ((so->state & (SO_VALID | SO_DELETED | SO_BUSY)) != SO_VALID)
+		return NULL;
+	if ((oh = scan_header(img, so, &tmp, &oh_buf)) == NULL)
+		return NULL;
+
+	if (so->id == YAFFS_OBJECTID_ROOT)
+		obj = yaffs_get_object(img, YAFFS_OBJECTID_ROOT);
+	else {
+		if (oh->type < YAFFS_OBJECT_TYPE_FILE ||
+		    oh->type > YAFFS_OBJECT_TYPE_SPECIAL || oh->name[0] == '\0' ||
+		    memchr(oh->name, '\0', sizeof(oh->name)) == NULL ||
+		    strchr(oh->name, '/') != NULL ||
+		    strcmp(oh->name, ".") == 0 || strcmp(oh->name, "..") == 0) {
+			scan_warn(img, "Invalid object header of object %u, skipping...",
+			          so->id);
+			so->state |= SO_DELETED;
+			return NULL;
+		}
+		so->state |= SO_BUSY;
+		parent = scan_parent(img, sc, so, oh->name);
+		so->state &= ~SO_BUSY;
+		if (parent == NULL)
+			return NULL;
+		/* lost+found may have been created meanwhile */
+		if ((obj = yaffs_get_object(img, so->id)) == NULL) {
+			obj = yaffs_new_object(img, so->id, parent, oh->type, oh->name);
+			if (obj == NULL || scan_list_add(img, obj) < 0)
+				return NULL;
+		}
+	}
+
+	obj->hdr_pos = tmp.hdr_pos;
+	obj->atime = oh->yst_atime;
+	obj->mtime = oh->yst_mtime;
+	obj->mode  = oh->yst_mode;
+	obj->uid   = oh->yst_uid;
+	obj->gid   = oh->yst_gid;
+	if (oh->type == YAFFS_OBJECT_TYPE_FILE) {
+		obj->file_size = tmp.file_size;
+		obj->chunks = img->chunk_map + so->map_first;
+		obj->chunk_count = so->map_count;
+	}
+	so->obj = obj;
+	return obj;
+}
+
+/* create the objects, hardlinks last, as their target must exist */
+static int scan_build(yaffs_image *img, struct scan *sc) {
+	yaffs_ObjectHeader oh_buf, *oh;
+	struct scan_object *so, *eq;
+	yaffs_object tmp;
+	unsigned i, no_header;
+
+	no_header = 0;
+	for (i = 0; i < sc->obj_count; i++) {
+		so = &sc->objs[i];
+		if (!(so->state & SO_VALID))
+			no_header++;
+		else if (so->type != YAFFS_OBJECT_TYPE_HARDLINK)
+			scan_create(img, sc, so);
+	}
+	for (i = 0; i < sc->obj_count; i++) {
+		so = &sc->objs[i];
+		if (so->type != YAFFS_OBJECT_TYPE_HARDLINK ||
+		    (so->state & (SO_VALID | SO_DELETED)) != SO_VALID ||
+		    (oh = scan_header(img, so, &tmp, &oh_buf)) == NULL)
+			continue;
+		eq = scan_find(sc, oh->equivalentObjectId);
+		if (eq == NULL || eq->obj == NULL ||
+		    eq->type == YAFFS_OBJECT_TYPE_HARDLINK) {
+			scan_warn(img, "Hardlink %u (%s) to missing object %u, skipping...",
+			          so->id, oh->name, oh->equivalentObjectId);
+			continue;
+		}
+		scan_create(img, sc, so);
+	}
+	if (no_header > 0)
+		scan_warn(img, "%u objects without header skipped", no_header);
+	return 0;
+}
+
+/*
+ * yaffs_full_scan - scan all chunks of a seekable image after the
+ * layout is set, then yaffs_next_object() returns the current objects.
+ * A file's data chunks are in obj->chunks, sorted by chunkId, chunks
+ * missing in between are holes. Data of a file, that is newer than its
+ * newest header, extends the file size.
+ */
+int yaffs_full_scan(yaffs_image *img) {
+	struct scan sc;
+	int ret;
+
+	if (!img->seekable)
+		return set_error(img, YAFFS_ERR_IO, 0,
+		                 "Full scan needs a seekable image file");
+	memset(&sc, 0, sizeof(sc));
+	if ((ret = scan_read(img, &sc)) >= 0 &&
+	    (ret = scan_objects(img, &sc)) >= 0) {
+		scan_resolve(img, &sc);
+		if ((ret = scan_map(img, &sc)) >= 0) {
+			img->chunk_maps = 1;
+			ret = scan_build(img, &sc);
+		}
+	}
+	free(sc.chunks);
+	free(sc.hdrs);
+	free(sc.objs);
+	return ret;
+}
+
+/*
+ * Chunk map scan (yaffs_map_scan): for images written like
+ * mkyaffs2image, with one version of each object, but the data chunks
+ * of the files interleaved or out of order. The object headers are
+ * processed in image order, every file gets a dense array indexed by
+ * chunkId (allocated with the objects), where its data chunks are
+ * entered by their objectId and chunkId. Data chunks preceding the
+ * header of their file wait in a packed list until the end of the scan.
+ */
+struct map_pending {
+	unsigned obj_id;
+	struct yaffs_chunk c;
+};
+
+/* enter a data chunk into the map of its file, a later copy wins */
+static int map_data(yaffs_image *img, yaffs_object *obj, struct yaffs_chunk *c) {
+	struct yaffs_chunk *ent;
+	char msg[80];
+
+	if (obj != NULL && obj->type == YAFFS_OBJECT_TYPE_FILE &&
+	    c->chunk_id >= 1 && c->chunk_id <= obj->chunk_count &&
+	    c->n_bytes <= img->chunk_size) {
+		ent = &obj->chunks[c->chunk_id - 1];
+		if (ent->pos >= 0)
+			img->stats.chunks_obsolete++;
+		ent->n_bytes = c->n_bytes;
+		ent->pos = c->pos;
+		return 0;
+	}
+	if (img->warn != NULL) {
+		snprintf(msg, sizeof(msg), "Invalid data chunk at chunk #%lld, skipping...",
+		         (long long)(c->pos / (img->chunk_size + img->spare_size)) + 1);
+		img->warn(img, msg);
+	}
+	if (++img->warn_count >= YAFFS_MAX_WARN)
+		return set_error(img, YAFFS_ERR_WARNINGS, 0, NULL);
+	return 0;
+}
+
+/* new object header: create the object and the chunk map of a file */
+static int map_header(yaffs_image *img, off_t pos) {
+	yaffs_ObjectHeader *oh;
+	yaffs_object *obj;
+	unsigned i, n;
+	int ret;
+
+	oh = (yaffs_ObjectHeader *)img->chunk_data;
+	if ((ret = add_object(img, oh, (yaffs_PackedTags2 *)img->spare_data, &obj)) < 0)
+		return ret;
+	obj->hdr_pos = pos;
+	if (obj->id == YAFFS_OBJECTID_ROOT)
+		return 0;
+	if ((ret = scan_list_add(img, obj)) < 0)
+		return ret;
+	if (oh->type != YAFFS_OBJECT_TYPE_FILE || oh->fileSize <= 0)
+		return 0;
+
+	obj->file_size = oh->fileSize;
+	n = (oh->fileSize - 1) / img->chunk_size + 1;
+	if ((obj->chunks = arena_alloc(img, n * sizeof(struct yaffs_chunk))) == NULL)
+		return set_error(img, YAFFS_ERR_NOMEM, 0, NULL);
+	obj->chunk_count = n;
+	for (i = 0; i < n; i++) {
+		obj->chunks[i].chunk_id = i + 1;
+		obj->chunks[i].n_bytes = 0;
+		obj->chunks[i].pos = -1;	/* missing */
+	}
+	return 0;
+}
+
+/*
+ * yaffs_map_scan - read all chunks of a seekable image after the layout
+ * is set, then yaffs_next_object() returns the objects in image order.
+ * A file's data chunks are in obj->chunks, indexed by chunkId - 1,
+ * missing chunks have pos -1.
+ */
+int yaffs_map_scan(yaffs_image *img) {
+	yaffs_PackedTags2 *pt;
+	yaffs_object *obj;
+	struct map_pending *pending, *p;
+	struct yaffs_chunk c;
+	unsigned count, alloc, i;
+	int ret;
+
+	if (!img->seekable)
+		return set_error(img, YAFFS_ERR_IO, 0,
+		                 "Chunk map scan needs a seekable image file");
+	pending = NULL;
+	count = alloc = 0;
+	while ((ret = yaffs_read_chunk(img)) > 0) {
+		pt = (yaffs_PackedTags2 *)img->spare_data;
+		c.chunk_id = pt->t.chunkId;
+		c.n_bytes = pt->t.byteCount;
+		c.pos = (off_t)(img->chunk_no - 1) * (img->chunk_size + img->spare_size);
+		if (pt->t.byteCount == 0xffffffff) {
+			img->stats.chunks_erased++;
+			if ((ret = skip_erased(img)) < 0)
+				break;
+		} else if (pt->t.byteCount == 0xffff && pt->t.chunkId == 0) {
+			if ((ret = map_header(img, c.pos)) < 0)
+				break;
+		} else if ((obj = yaffs_get_object(img, pt->t.objectId)) != NULL) {
+			if ((ret = map_data(img, obj, &c)) < 0)
+				break;
+		} else {				/* header follows later */
+			if (count >= alloc) {
+				alloc = alloc ? 2 * alloc : 1024;
+				if ((p = realloc(pending, alloc * sizeof(*p))) == NULL) {
+					ret = set_error(img, YAFFS_ERR_NOMEM, 0, NULL);
+					break;
+				}
+				pending = p;
+			}
+			pending[count].obj_id = pt->t.objectId;
+			pending[count++].c = c;
+		}
+	}
+	for (i = 0; i < count && ret >= 0; i++)
+		ret = map_data(img, yaffs_get_object(img, pending[i].obj_id),
+		               &pending[i].c);
+	free(pending);
+	if (ret < 0)
+		return ret;
+	img->chunk_maps = 1;
+	return 0;
+}
+
+/*
+ * yaffs_data_pos - image position of data chunk idx (from 0) of a file,
+ * -1 for a missing chunk (a hole)
+ */
+off_t yaffs_data_pos(yaffs_image *img, yaffs_object *obj, int idx) {
+	unsigned lo, hi, mid;
+
+	if (!img->chunk_maps)
+		return obj->hdr_pos + (off_t)(idx + 1) * (img->chunk_size + img->spare_size);
+	if ((unsigned)idx < obj->chunk_count &&		/* dense map */
+	    obj->chunks[idx].chunk_id == (unsigned)idx + 1)
+		return obj->chunks[idx].pos;
+	lo = 0; hi = obj->chunk_count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (obj->chunks[mid].chunk_id < (unsigned)idx + 1)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < obj->chunk_count && obj->chunks[lo].chunk_id == (unsigned)idx + 1)
+		return obj->chunks[lo].pos;
+	return -1;
+}
@@ -0,0 +1,200 @@
+/*
+ * libunyaffs: read YAFFS2 file system images
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * All state of an image is kept in its yaffs_image handle, so several
+ * images can be read at the same time (one thread per handle).
+ * Functions don't exit on errors, they return a negative YAFFS_ERR_xxx
+ * code; yaffs_errmsg() gives a detailed message of the last error.
+ *
+ * Typical use:
+ *
+ *	yaffs_open(&img, fd, 0);
+ *	yaffs_probe_layout(img, 0, 0);
+ *	while ((ret = yaffs_next_object(img, &obj, &oh)) > 0)
+ *		while ((ret = yaffs_next_data(img, &data, &len)) > 0)
+ *			...
+ *	yaffs_close(img);
+ *
+ * Images of used flash partitions (nanddump) contain old versions of
+ * objects and data chunks. yaffs_full_scan() resolves them first, then
+ * yaffs_next_object() returns the current objects, parents first, and
+ * the file data is found with the chunk map of each file.
+ * yaffs_map_scan() does the same for images with only one version of
+ * each object, but the data chunks interleaved or out of order.
+ */
+
+#ifndef __LIBUNYAFFS_H__
+#define __LIBUNYAFFS_H__
+
+#include <sys/types.h>
+#include "unyaffs.h"
+
+#define UNYAFFS_VERSION		"0.9"
+
+#define YAFFS_MAX_CHUNK_SIZE	16384
+#define YAFFS_MAX_SPARE_SIZE	 1280
+#define YAFFS_DETECT_SIZE	(2*(YAFFS_MAX_CHUNK_SIZE + YAFFS_MAX_SPARE_SIZE))
+#define YAFFS_BUF_SIZE		(4*1024*1024)	/* default read buffer */
+#define YAFFS_MAX_WARN		   20
+#define YAFFS_OBJECTID_ROOT	    1
+
+/* error codes, functions return them negated */
+enum {
+	YAFFS_OK = 0,
+	YAFFS_ERR_IO,			/* read or seek error, see errno */
+	YAFFS_ERR_NOMEM,		/* out of memory */
+	YAFFS_ERR_NOT_YAFFS,		/* not a yaffs2 image */
+	YAFFS_ERR_LAYOUT,		/* chunk and spare size unknown */
+	YAFFS_ERR_BROKEN,		/* truncated image */
+	YAFFS_ERR_OBJECT,		/* invalid object header */
+	YAFFS_ERR_WARNINGS		/* too many invalid chunks */
+};
+
+struct yaffs_layout {
+	int chunk_size;
+	int spare_size;
+	int block_chunks;		/* chunks per erase block, 0 if unknown */
+};
+
+/* mkyaffs2image layouts, option -l of unyaffs */
+extern const struct yaffs_layout yaffs_layouts[];
+extern const int yaffs_layout_count;
+
+/* data chunk of a file, found by the full or chunk map scan */
+struct yaffs_chunk {
+	unsigned chunk_id;		/* position in the file, from 1 */
+	unsigned n_bytes;
+	off_t    pos;			/* image position */
+};
+
+typedef struct yaffs_object {
+	unsigned id;
+	yaffs_ObjectType type;
+	struct yaffs_object *parent;	/* NULL for the root directory */
+	unsigned prev_dir_id;		/* chain of directories */
+	off_t    hdr_pos;		/* image position of object header */
+	int      file_size;
+	__u32    atime;
+	__u32    mtime;
+	__u32    mode;			/* directory attributes, in case the */
+	__u32    uid;			/* header can't be read again */
+	__u32    gid;
+	struct yaffs_chunk *chunks;	/* data chunks by chunk_id, after a */
+					/* full or chunk map scan */
+	unsigned chunk_count;
+	unsigned char flags;		/* free for the application */
+	char     name[1];		/* variable length, must be last */
+} yaffs_object;
+
+/* counters of an image, maintained by the library */
+struct yaffs_stats {
+	unsigned long chunks_read;	/* chunks read in sequence */
+	unsigned long chunks_skipped;	/* data chunks and holes skipped */
+	unsigned long chunks_erased;	/* erased chunks between objects */
+	unsigned long chunks_obsolete;	/* full scan: replaced or deleted */
+	unsigned long read_calls;	/* read() and pread() */
+	unsigned long seek_calls;
+	unsigned long long bytes_read;
+};
+
+struct yaffs_arena;
+struct yaffs_pipe;
+
+/*
+ * image handle, the fields may be read by the application,
+ * but are only changed by the library functions. Exceptions are
+ * the callbacks warn (invalid chunks, default: ignored) and
+ * refill_hook, which the application may set after yaffs_open().
+ */
+typedef struct yaffs_image {
+	int      fd;
+	int      seekable;
+	unsigned char *map;		/* mmap of image file, if possible */
+	off_t    size;
+	off_t    pos;			/* read position in map */
+	off_t    hole_start;		/* next hole of a sparse image file */
+	off_t    hole_end;
+
+	unsigned char *buffer;		/* read buffer for unmapped images */
+	size_t   buf_size;
+	size_t   buf_len;
+	size_t   buf_idx;
+	struct yaffs_pipe *pipe;	/* reader thread for non-seekable images */
+	void   (*refill_hook)(void);	/* called before buffer contents move */
+
+	int      chunk_size;
+	int      spare_size;
+	int      block_chunks;		/* 0 if unknown */
+	int      chunk_no;		/* number of current chunk, from 1 */
+	unsigned char *chunk_data;	/* current chunk */
+	unsigned char *spare_data;
+
+	yaffs_ObjectHeader hdr;		/* current header, if not mapped */
+	int      data_remain;		/* unread data of current file */
+	int      warn_count;
+	void   (*warn)(struct yaffs_image *img, const char *msg);
+
+	yaffs_object **obj_table;	/* open addressing hash table */
+	unsigned obj_table_size;	/* power of 2 */
+	unsigned obj_table_used;
+	struct yaffs_arena *arena;	/* objects, freed all at once */
+	unsigned last_dir_id;
+
+	int      chunk_maps;		/* objects and chunk maps from */
+					/* yaffs_full_scan() or yaffs_map_scan() */
+	struct yaffs_chunk *chunk_map;	/* full scan: data chunks of all files */
+	yaffs_object **scan_list;	/* scanned objects, parents first */
+	unsigned scan_count;
+	unsigned scan_alloc;
+	unsigned scan_next;
+
+	struct yaffs_stats stats;
+
+	int      err_errno;
+	char     err_msg[256];
+} yaffs_image;
+
+/* image handle */
+int  yaffs_open(yaffs_image **imgp, int fd, size_t buf_size);
+void yaffs_close(yaffs_image *img);
+const char *yaffs_strerror(int err);
+const char *yaffs_errmsg(yaffs_image *img);
+
+/* layout, sizes of 0 are detected by yaffs_probe_layout() */
+int  yaffs_probe_layout(yaffs_image *img, int chunk_size, int spare_size);
+int  yaffs_set_layout(yaffs_image *img, int chunk_size, int spare_size,
+                      int block_chunks);
+
+/* sequential chunk access */
+int  yaffs_read_chunk(yaffs_image *img);
+int  yaffs_chunk_buffered(yaffs_image *img);
+int  yaffs_skip_chunks(yaffs_image *img, int count);
+
+/* object iterator */
+int  yaffs_scan_header(yaffs_image *img, yaffs_object **objp);
+int  yaffs_next_object(yaffs_image *img, yaffs_object **objp,
+                       yaffs_ObjectHeader **ohp);
+int  yaffs_next_data(yaffs_image *img, const unsigned char **datap, int *lenp);
+int  yaffs_skip_data(yaffs_image *img);
+
+/* full scan of a used flash partition and chunk map scan (seekable images) */
+int  yaffs_full_scan(yaffs_image *img);
+int  yaffs_map_scan(yaffs_image *img);
+off_t yaffs_data_pos(yaffs_image *img, yaffs_object *obj, int idx);
+
+/* object table */
+yaffs_object *yaffs_get_object(yaffs_image *img, unsigned id);
+yaffs_object *yaffs_new_object(yaffs_image *img, unsigned id,
+                               yaffs_object *parent, yaffs_ObjectType type,
+                               const char *name);
+yaffs_ObjectHeader *yaffs_read_header(yaffs_image *img, yaffs_object *obj,
+                                      yaffs_ObjectHeader *buf);
+const char *yaffs_path(yaffs_object *obj);
+
+#endif
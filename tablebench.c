@@ -0,0 +1,197 @@
+/*
+ * tablebench: micro-benchmark of the object table of libunyaffs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Inserts n objects into the object table of an image handle, like a
+ * scan does (ids counting from 257, in order), then looks them all up
+ * in a scattered order, looks up as many missing ids and frees the
+ * table. For comparison the same is done with the chained hash table
+ * of 7001 buckets and one malloc() per object, which unyaffs used
+ * before; its chains get long, so only up to 100000 lookups are timed.
+ * Times are given per operation, the free time in total.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libunyaffs.h"
+
+#define FIRST_OBJECT_ID		  257
+#define HASH_SIZE		 7001
+#define LOOKUP_STEP	      1000003	/* prime, scatters the lookups */
+#define CHAINED_LOOKUPS	       100000	/* the chains get long, limit lookups */
+
+/* the previous object table */
+typedef struct t_chained {
+	struct t_chained *next;
+	unsigned id;
+	yaffs_ObjectType type;
+	struct t_chained *parent;
+	char name[];
+} chained;
+
+chained *chained_list[HASH_SIZE];
+
+static chained *chained_get(unsigned id) {
+	chained *obj;
+
+	obj = chained_list[id % HASH_SIZE];
+	while (obj != NULL && obj->id != id)
+		obj = obj->next;
+	return obj;
+}
+
+static chained *chained_new(unsigned id, chained *parent,
+                            yaffs_ObjectType type, const char *name) {
+	chained *obj;
+
+	obj = malloc(sizeof(chained) + strlen(name) + 1);
+	if (obj == NULL)
+		return NULL;
+	obj->id = id;
+	obj->type = type;
+	obj->parent = parent;
+	strcpy(obj->name, name);
+	obj->next = chained_list[id % HASH_SIZE];
+	chained_list[id % HASH_SIZE] = obj;
+	return obj;
+}
+
+static void chained_free(void) {
+	chained *obj;
+	int idx;
+
+	for (idx = 0; idx < HASH_SIZE; idx++)
+		while ((obj = chained_list[idx]) != NULL) {
+			chained_list[idx] = obj->next;
+			free(obj);
+		}
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* object id of the i-th lookup, every object once */
+static inline unsigned lookup_id(unsigned i, unsigned n) {
+	return FIRST_OBJECT_ID + (unsigned)(((unsigned long long)i * LOOKUP_STEP) % n);
+}
+
+static void fail(const char *msg) {
+	fprintf(stderr, "%s\n", msg);
+	exit(1);
+}
+
+static void bench_table(unsigned n, int fd) {
+	yaffs_image *img;
+	yaffs_object *root;
+	char name[16];
+	double t0, t1, t2, t3, t4;
+	unsigned i, found;
+
+	if (yaffs_open(&img, fd, 0) < 0)
+		fail("Can't open image handle");
+	root = yaffs_get_object(img, YAFFS_OBJECTID_ROOT);
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "f%u", i);
+		if (yaffs_new_object(img, FIRST_OBJECT_ID + i, root,
+		                     YAFFS_OBJECT_TYPE_FILE, name) == NULL)
+			fail("Out of memory");
+	}
+	t1 = now();
+	found = 0;
+	for (i = 0; i < n; i++)
+		found += yaffs_get_object(img, lookup_id(i, n)) != NULL;
+	t2 = now();
+	for (i = 0; i < n; i++)
+		found += yaffs_get_object(img, FIRST_OBJECT_ID + n + i) != NULL;
+	t3 = now();
+	yaffs_close(img);
+	t4 = now();
+	if (found != n)
+		fail("Lookup failed");
+
+	printf("%9u  %-8s %9.1f %9.1f %9.1f %9.1f\n", n, "open",
+	       (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n, (t3 - t2) * 1e9 / n,
+	       (t4 - t3) * 1e3);
+	fflush(stdout);
+}
+
+static void bench_chained(unsigned n) {
+	chained *root;
+	char name[16];
+	double t0, t1, t2, t3, t4;
+	unsigned i, found, lookups;
+
+	if ((root = chained_new(YAFFS_OBJECTID_ROOT, NULL,
+	                        YAFFS_OBJECT_TYPE_DIRECTORY, ".")) == NULL)
+		fail("Out of memory");
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "f%u", i);
+		if (chained_new(FIRST_OBJECT_ID + i, root,
+		                YAFFS_OBJECT_TYPE_FILE, name) == NULL)
+			fail("Out of memory");
+	}
+	t1 = now();
+	lookups = n < CHAINED_LOOKUPS ? n : CHAINED_LOOKUPS;
+	found = 0;
+	for (i = 0; i < lookups; i++)
+		found += chained_get(lookup_id(i, n)) != NULL;
+	t2 = now();
+	for (i = 0; i < lookups; i++)
+		found += chained_get(FIRST_OBJECT_ID + n + i) != NULL;
+	t3 = now();
+	chained_free();
+	t4 = now();
+	if (found != lookups)
+		fail("Lookup failed");
+
+	printf("%9u  %-8s %9.1f %9.1f %9.1f %9.1f\n", n, "chained",
+	       (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / lookups,
+	       (t3 - t2) * 1e9 / lookups, (t4 - t3) * 1e3);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	unsigned n, max;
+	char *end;
+	int fd;
+
+	max = 10000000;
+	if (argc > 1) {
+		max = strtoul(argv[1], &end, 10);
+		if (argc > 2 || *end != '\0' || max < 1) {
+			fprintf(stderr, "Usage: tablebench [<max. objects>]\n");
+			exit(1);
+		}
+	}
+	if ((fd = open("/dev/null", O_RDONLY)) < 0)
+		fail("Can't open /dev/null");
+
+	printf("  objects  table    insert ns lookup ns   miss ns   free ms\n");
+	for (n = 10000; n <= max; n *= 10) {
+		bench_table(n, fd);
+		bench_chained(n);
+		if (n > max / 10)
+			break;
+	}
+	close(fd);
+	return 0;
+}
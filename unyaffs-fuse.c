@@ -0,0 +1,522 @@
+/*
+ * unyaffs-fuse: mount a yaffs2 file system image read-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * The object table is built with one scan of the object headers by
+ * libunyaffs, afterwards attributes, directories and file data are
+ * served directly from the image. Headers are read again when needed,
+ * file data is read with pread() (through a small LRU cache of chunks)
+ * or from the mapping.
+ */
+
+#define FUSE_USE_VERSION	31
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fuse.h>
+
+#include "libunyaffs.h"
+
+#define FS_CACHE_SIZE		   64	/* chunks */
+
+typedef yaffs_object object;
+
+yaffs_image *img = NULL;
+int opt_verbose = 0;
+
+/* error reporting function, similar to GNU error() */
+static void prt_err(int status, int errnum, const char *format, ...) {
+	va_list varg;
+
+	va_start(varg, format);
+	fflush(stdout);
+	vfprintf(stderr, format, varg);
+	if (errnum != 0)
+		fprintf(stderr, ": %s", strerror(errnum));
+	fprintf(stderr, "\n");
+	va_end(varg);
+
+	if (status != 0)
+		exit(status);
+}
+
+/* library errors are fatal */
+static void img_fail(void) {
+	prt_err(1, img->err_errno, "%s", yaffs_errmsg(img));
+}
+
+static void img_warn(yaffs_image *image, const char *msg) {
+	prt_err(0, 0, "Warning: %s", msg);
+}
+
+/* set the layout, detect the sizes that aren't given */
+static void set_layout(const struct yaffs_layout *layout) {
+	if (layout->chunk_size == 0 || layout->spare_size == 0) {
+		if (yaffs_probe_layout(img, layout->chunk_size, layout->spare_size) < 0 ||
+		    (layout->block_chunks != 0 &&
+		     yaffs_set_layout(img, img->chunk_size, img->spare_size,
+		                      layout->block_chunks) < 0))
+			img_fail();
+		if (opt_verbose && img->block_chunks != 0)
+			fprintf(stderr, "Header check OK, chunk size = %d, spare size = %d, "
+			        "block = %d chunks.\n", img->chunk_size,
+			        img->spare_size, img->block_chunks);
+		else if (opt_verbose)
+			fprintf(stderr,
+			        "Header check OK, chunk size = %d, spare size = %d.\n",
+			        img->chunk_size, img->spare_size);
+	} else if (yaffs_set_layout(img, layout->chunk_size, layout->spare_size,
+	                            layout->block_chunks) < 0)
+		img_fail();
+}
+
+static object **fs_list = NULL;		/* objects sorted by parent and name */
+static int fs_count = 0;
+static int fs_alloc = 0;
+
+static struct t_chunk_cache {
+	off_t    pos;
+	unsigned long used;
+	unsigned char *data;
+} fs_cache[FS_CACHE_SIZE];
+
+static unsigned long fs_cache_clock = 0;
+static pthread_mutex_t fs_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t fs_img_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cmp_fs_obj(const object *a, unsigned parent_id, const char *name) {
+	if (a->parent->id != parent_id)
+		return a->parent->id < parent_id ? -1 : 1;
+	return strcmp(a->name, name);
+}
+
+static int cmp_fs_list(const void *a, const void *b) {
+	const object *obj_b = *(const object **)b;
+
+	return cmp_fs_obj(*(const object **)a, obj_b->parent->id, obj_b->name);
+}
+
+/* first entry in fs_list not less than (parent_id, name) */
+static int fs_lower_bound(unsigned parent_id, const char *name) {
+	int lo, hi, mid;
+
+	lo = 0; hi = fs_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cmp_fs_obj(fs_list[mid], parent_id, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* object of a path name, NULL if it doesn't exist */
+static object *fs_lookup(const char *path) {
+	object *obj;
+	char name[NAME_MAX + 1];
+	size_t len;
+	int i;
+
+	obj = yaffs_get_object(img, YAFFS_OBJECTID_ROOT);
+	for (;;) {
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			return obj;
+		if (obj->type != YAFFS_OBJECT_TYPE_DIRECTORY)
+			return NULL;
+		len = strcspn(path, "/");
+		if (len > NAME_MAX)
+			return NULL;
+		memcpy(name, path, len);
+		name[len] = '\0';
+		path += len;
+		i = fs_lower_bound(obj->id, name);
+		if (i >= fs_count || cmp_fs_obj(fs_list[i], obj->id, name) != 0)
+			return NULL;
+		obj = fs_list[i];
+	}
+}
+
+/*
+ * object header, NULL for the root without header or on read errors.
+ * FUSE calls from several threads; the library functions only read the
+ * object table, but yaffs_read_header() sets the error state of the
+ * image handle, so it's locked.
+ */
+static yaffs_ObjectHeader *fs_header(object *obj, yaffs_ObjectHeader *buf) {
+	yaffs_ObjectHeader *oh;
+
+	if (obj->hdr_pos < 0 && obj->parent == NULL)
+		return NULL;
+	pthread_mutex_lock(&fs_img_lock);
+	oh = yaffs_read_header(img, obj, buf);
+	pthread_mutex_unlock(&fs_img_lock);
+	return oh;
+}
+
+/* the object a hardlink points to */
+static object *fs_resolve(object *obj) {
+	yaffs_ObjectHeader oh_buf, *oh;
+
+	if (obj->type != YAFFS_OBJECT_TYPE_HARDLINK)
+		return obj;
+	if ((oh = fs_header(obj, &oh_buf)) == NULL)
+		return NULL;
+	return yaffs_get_object(img, oh->equivalentObjectId);
+}
+
+/* copy part of a data chunk, unmapped chunks go through the LRU cache */
+static int fs_read_chunk(off_t pos, char *buf, int offset, int len) {
+	struct t_chunk_cache *ent, *lru;
+	int i, ret;
+
+	if (pos + img->chunk_size > img->size)
+		return -EIO;
+	if (img->map != NULL) {
+		memcpy(buf, img->map + pos + offset, len);
+		return 0;
+	}
+
+	ret = 0;
+	pthread_mutex_lock(&fs_cache_lock);
+	ent = lru = &fs_cache[0];
+	for (i = 0; i < FS_CACHE_SIZE; i++) {
+		ent = &fs_cache[i];
+		if (ent->pos == pos)
+			break;
+		if (ent->used < lru->used)
+			lru = ent;
+	}
+	if (i >= FS_CACHE_SIZE) {		/* not cached, replace lru entry */
+		ent = lru;
+		ent->pos = -1;
+		if (pread(img->fd, ent->data, img->chunk_size, pos) != img->chunk_size)
+			ret = -EIO;
+		else
+			ent->pos = pos;
+	}
+	if (ret == 0) {
+		ent->used = ++fs_cache_clock;
+		memcpy(buf, ent->data + offset, len);
+	}
+	pthread_mutex_unlock(&fs_cache_lock);
+	return ret;
+}
+
+static int fs_getattr(const char *path, struct stat *st,
+                      struct fuse_file_info *fi) {
+	yaffs_ObjectHeader oh_buf, *oh;
+	object *obj;
+
+	if ((obj = fs_lookup(path)) == NULL)
+		return -ENOENT;
+	if ((obj = fs_resolve(obj)) == NULL)
+		return -EIO;
+
+	memset(st, 0, sizeof(*st));
+	st->st_ino = obj->id;
+	st->st_nlink = 1;
+	if ((oh = fs_header(obj, &oh_buf)) == NULL) {	/* root without header */
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return 0;
+	}
+	st->st_uid = oh->yst_uid;
+	st->st_gid = oh->yst_gid;
+	st->st_atime = oh->yst_atime;
+	st->st_mtime = oh->yst_mtime;
+	st->st_ctime = oh->yst_ctime;
+	switch(oh->type) {
+		case YAFFS_OBJECT_TYPE_FILE:
+			st->st_mode = S_IFREG | (oh->yst_mode & 07777);
+			st->st_size = oh->fileSize > 0 ? oh->fileSize : 0;
+			break;
+		case YAFFS_OBJECT_TYPE_DIRECTORY:
+			st->st_mode = S_IFDIR | (oh->yst_mode & 07777);
+			st->st_nlink = 2;
+			break;
+		case YAFFS_OBJECT_TYPE_SYMLINK:
+			st->st_mode = S_IFLNK | 0777;
+			st->st_size = strlen(oh->alias);
+			break;
+		case YAFFS_OBJECT_TYPE_SPECIAL:
+			st->st_mode = oh->yst_mode;
+			st->st_rdev = oh->yst_rdev;
+			break;
+		default:
+			return -EIO;
+	}
+	st->st_blocks = (st->st_size + 511) / 512;
+	return 0;
+}
+
+static int fs_readlink(const char *path, char *buf, size_t size) {
+	yaffs_ObjectHeader oh_buf, *oh;
+	object *obj;
+
+	if ((obj = fs_lookup(path)) == NULL)
+		return -ENOENT;
+	if (obj->type != YAFFS_OBJECT_TYPE_SYMLINK)
+		return -EINVAL;
+	if ((oh = fs_header(obj, &oh_buf)) == NULL)
+		return -EIO;
+	if (size == 0)
+		return -EINVAL;
+	snprintf(buf, size, "%s", oh->alias);
+	return 0;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                      off_t offset, struct fuse_file_info *fi,
+                      enum fuse_readdir_flags flags) {
+	object *obj;
+	int i;
+
+	if ((obj = fs_lookup(path)) == NULL)
+		return -ENOENT;
+	if (obj->type != YAFFS_OBJECT_TYPE_DIRECTORY)
+		return -ENOTDIR;
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	for (i = fs_lower_bound(obj->id, "");
+	     i < fs_count && fs_list[i]->parent == obj; i++)
+		if (filler(buf, fs_list[i]->name, NULL, 0, 0) != 0)
+			break;
+	return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi) {
+	object *obj;
+
+	if ((obj = fs_lookup(path)) == NULL)
+		return -ENOENT;
+	if ((obj = fs_resolve(obj)) == NULL)
+		return -EIO;
+	if (obj->type != YAFFS_OBJECT_TYPE_FILE)
+		return -EINVAL;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+	fi->fh = (uintptr_t)obj;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi) {
+	object *obj;
+	off_t pos;
+	size_t done, len;
+	int idx, chunk_off, ret;
+
+	obj = (object *)(uintptr_t)fi->fh;
+	if (offset >= obj->file_size)
+		return 0;
+	if (offset + size > obj->file_size)
+		size = obj->file_size - offset;
+
+	for (done = 0; done < size; done += len) {
+		idx = (offset + done) / img->chunk_size;
+		chunk_off = (offset + done) % img->chunk_size;
+		len = img->chunk_size - chunk_off;
+		if (len > size - done)
+			len = size - done;
+		pos = yaffs_data_pos(img, obj, idx);
+		if (pos < 0)			/* hole */
+			memset(buf + done, 0, len);
+		else if ((ret = fs_read_chunk(pos, buf + done, chunk_off, len)) < 0)
+			return ret;
+	}
+	return size;
+}
+
+static struct fuse_operations fs_ops = {
+	.getattr  = fs_getattr,
+	.readlink = fs_readlink,
+	.open     = fs_open,
+	.read     = fs_read,
+	.readdir  = fs_readdir,
+};
+
+static void usage(void) {
+	fprintf(stderr, "\
+unyaffs-fuse - mount a YAFFS2 file system image read-only.\n\
+\n\
+Usage: unyaffs-fuse [-f | -m] [-l <layout>] [--chunk-size <bytes>]\n\
+                    [--spare-size <bytes>] [--block-chunks <count>] [-v]\n\
+                    <image_file_name> <mount point> [<fuse options>]\n\
+    -f               full scan, for images (nanddumps) of used partitions\n\
+    -m               map the data chunks of each file by chunkId, for images\n\
+                     with interleaved or out of order chunks\n\
+    -l <layout>      set flash memory layout\n\
+        layout=0: detect chunk and spare size (default)\n\
+        layout=1:  2K chunk,  64 byte spare size\n\
+        layout=2:  4K chunk, 128 byte spare size\n\
+        layout=3:  8K chunk, 256 byte spare size\n\
+        layout=4: 16K chunk, 512 byte spare size\n\
+    --chunk-size <bytes>   set chunk (page) size, 512 to 16384\n\
+    --spare-size <bytes>   set spare (oob) size, 16 to 1280\n\
+    --block-chunks <count> set chunks per erase block\n\
+    -v               verbose output\n\
+    -V               print version\n\
+");
+	exit(1);
+}
+
+enum { OPT_CHUNK_SIZE = 256, OPT_SPARE_SIZE, OPT_BLOCK_CHUNKS };
+
+static struct option long_options[] = {
+	{ "chunk-size",   required_argument, NULL, OPT_CHUNK_SIZE },
+	{ "spare-size",   required_argument, NULL, OPT_SPARE_SIZE },
+	{ "block-chunks", required_argument, NULL, OPT_BLOCK_CHUNKS },
+	{ NULL, 0, NULL, 0 }
+};
+
+/* numeric option value, min to max */
+static int get_number(const char *arg, long min, long max) {
+	char *end;
+	long val;
+
+	val = strtol(arg, &end, 10);
+	if (*end != '\0' || val < min || val > max)
+		usage();
+	return val;
+}
+
+int main(int argc, char **argv) {
+	char **fuse_argv;
+	int fuse_argc;
+	int img_file;
+	int opt_full, opt_map;
+	struct yaffs_layout layout = { 0, 0, 0 };
+	yaffs_ObjectHeader *oh;
+	object *obj;
+	int ch, i, ret;
+
+	/* handle command line options, up to the image name */
+	opt_full = 0;
+	opt_map = 0;
+	while ((ch = getopt_long(argc, argv, "+fl:mvVh?",
+	                         long_options, NULL)) > 0) {
+		switch (ch) {
+			case 'f':
+				opt_full = 1;
+				break;
+			case 'l':
+				i = get_number(optarg, 0, yaffs_layout_count);
+				if (i == 0)
+					layout.chunk_size = layout.spare_size = 0;
+				else {
+					layout.chunk_size = yaffs_layouts[i-1].chunk_size;
+					layout.spare_size = yaffs_layouts[i-1].spare_size;
+				}
+				break;
+			case OPT_CHUNK_SIZE:
+				layout.chunk_size = get_number(optarg,
+				        sizeof(yaffs_ObjectHeader), YAFFS_MAX_CHUNK_SIZE);
+				break;
+			case OPT_SPARE_SIZE:
+				layout.spare_size = get_number(optarg,
+				        sizeof(yaffs_PackedTags2TagsPart), YAFFS_MAX_SPARE_SIZE);
+				break;
+			case OPT_BLOCK_CHUNKS:
+				layout.block_chunks = get_number(optarg, 1, 65536);
+				break;
+			case 'm':
+				opt_map = 1;
+				break;
+			case 'v':
+				opt_verbose = 1;
+				break;
+			case 'V':
+				printf("V%s\n", UNYAFFS_VERSION);
+				exit(0);
+				break;
+			case 'h':
+			case '?':
+			default:
+				usage();
+				break;
+		}
+	}
+	if ((argc - optind) < 2 || (opt_full && opt_map))
+		usage();
+
+	img_file = open(argv[optind], O_RDONLY);
+	if (img_file < 0)
+		prt_err(1, errno, "Open image file failed");
+	if ((ret = yaffs_open(&img, img_file, 0)) < 0)
+		prt_err(1, ret == -YAFFS_ERR_NOMEM ? 0 : errno, "%s",
+		        yaffs_strerror(ret));
+	if (!img->seekable)
+		prt_err(1, 0, "Image must be a seekable file");
+	img->warn = img_warn;
+
+	/* scan the object headers, collect all objects except the root */
+	set_layout(&layout);
+	if (opt_full && yaffs_full_scan(img) < 0)
+		img_fail();
+	if (opt_map && yaffs_map_scan(img) < 0)
+		img_fail();
+	while ((ret = yaffs_next_object(img, &obj, &oh)) > 0) {
+		if (obj->parent == NULL || obj->type == YAFFS_OBJECT_TYPE_UNKNOWN)
+			continue;
+		if (fs_count >= fs_alloc) {
+			fs_alloc = fs_alloc ? 2 * fs_alloc : 1024;
+			fs_list = realloc(fs_list, fs_alloc * sizeof(object *));
+			if (fs_list == NULL)
+				prt_err(1, 0, "Malloc object list failed.");
+		}
+		fs_list[fs_count++] = obj;
+	}
+	if (ret < 0)
+		img_fail();
+	qsort(fs_list, fs_count, sizeof(object *), cmp_fs_list);
+
+	for (i = 0; i < FS_CACHE_SIZE; i++) {
+		fs_cache[i].pos = -1;
+		fs_cache[i].used = 0;
+		if (img->map == NULL &&
+		    (fs_cache[i].data = malloc(img->chunk_size)) == NULL)
+			prt_err(1, 0, "Malloc chunk cache failed.");
+	}
+
+	/* fuse gets the mount point and the remaining options, read-only */
+	fuse_argv = malloc((argc - optind + 3) * sizeof(char *));
+	if (fuse_argv == NULL)
+		prt_err(1, 0, "Malloc argument list failed.");
+	fuse_argc = 0;
+	fuse_argv[fuse_argc++] = argv[0];
+	fuse_argv[fuse_argc++] = "-o";
+	fuse_argv[fuse_argc++] = "ro";
+	for (i = optind + 1; i < argc; i++)
+		fuse_argv[fuse_argc++] = argv[i];
+	fuse_argv[fuse_argc] = NULL;
+	ret = fuse_main(fuse_argc, fuse_argv, &fs_ops, NULL);
+
+	free(fuse_argv);
+	for (i = 0; i < FS_CACHE_SIZE; i++)
+		free(fs_cache[i].data);
+	free(fs_list);
+	yaffs_close(img);
+	close(img_file);
+	return ret;
+}
@@ -26,15 +26,23 @@
  *   Optional base dir for file extraction
  */
 
-#define VERSION		"0.9"
-
-/* check if lutimes is available */
-#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || (defined(__APPLE__) && defined(__MACH__))
-#define HAS_LUTIMES 1
+#ifdef __linux__
+#define _GNU_SOURCE		/* fallocate() */
+/* check if io_uring is available */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAS_IO_URING 1
+#endif
+#endif
 #endif
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -44,103 +52,152 @@
 #include <stdarg.h>
 #include <time.h>
 #include <errno.h>
-#ifdef HAS_LUTIMES
-#include <sys/time.h>
-#else
-#include <utime.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <setjmp.h>
+
+#ifdef HAS_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #endif
 
-#include "unyaffs.h"
+#include "libunyaffs.h"
 
-#define MAX_CHUNK_SIZE		16384
-#define MAX_SPARE_SIZE		  512
-#define HASH_SIZE		 7001
-#define MAX_WARN		   20
-#define YAFFS_OBJECTID_ROOT	    1
+#define WRITE_BUF_SIZE		(1024*1024)	/* max. bytes per pwritev() */
+#define MAX_IOV			  256
 
 #define STD_PERMS		(S_IRWXU|S_IRWXG|S_IRWXO)
 #define EXTRA_PERMS		(S_ISUID|S_ISGID|S_ISVTX)
 
-static struct t_layout {
-	int chunk_size;
-	int spare_size;
-} possible_layouts[] =
-	{ { 2048, 64 }, { 4096, 128 }, { 8192, 256 }, { 16384, 512 } };
-
-int max_layout = sizeof(possible_layouts) / sizeof(struct t_layout);
-
-unsigned char data[MAX_CHUNK_SIZE + MAX_SPARE_SIZE];
-unsigned char buffer[2*(MAX_CHUNK_SIZE + MAX_SPARE_SIZE)];
-unsigned char *chunk_data = data;
-unsigned char *spare_data = NULL;
-int chunk_size = 2048;
-int spare_size = 64;
-int buf_len = 0;
-int buf_idx = 0;
-int chunk_no   = 0;
-int warn_count = 0;
-int img_file;
+size_t buf_size = 0;			/* read buffer size, 0 for default */
 int opt_list;
 int opt_verbose;
-
-typedef struct _object {
+int opt_threads;
+int opt_sparse;
+int opt_uring;
+int opt_index;
+int opt_stats;
+int opt_full;				/* full scan of a used partition (-f) */
+int opt_map;				/* chunk map scan (-m) */
+int opt_prealloc;			/* preallocate files (fallocate) */
+int tar_fd = -1;			/* archive output instead of files */
+off_t tar_pos = 0;
+int out_stream = 0;			/* file data goes to archive or stdout */
+char *cat_path = NULL;			/* file to write to stdout (-x) */
+
+typedef yaffs_object object;
+
+#define OBJ_INCLUDED		0x01	/* object or a parent matches --include */
+#define OBJ_EXCLUDED		0x02	/* object or a parent matches --exclude */
+#define OBJ_CREATED		0x04	/* directory exists in the output */
+
+#define DIR_CACHE_SIZE		   64
+
+struct t_dir_cache {
 	unsigned id;
-	struct _object *next;
-	yaffs_ObjectType type;
-	unsigned prev_dir_id;
-	__u32    atime;
-	__u32    mtime;
-	char     path_name[1];		/* variable length, must be last */
-} object;
-
-object *obj_list[HASH_SIZE];
-
-unsigned last_dir_id;
-
-int set_utime(const char *filename, __u32 yst_atime, __u32 yst_mtime) {
-#ifdef HAS_LUTIMES
-	struct timeval ftime[2];
-
-	ftime[0].tv_sec  = yst_atime;
-	ftime[0].tv_usec = 0;
-	ftime[1].tv_sec  = yst_mtime;
-	ftime[1].tv_usec = 0;
+	int      fd;
+	int      refs;
+	unsigned long used;
+};
 
-	return lutimes(filename, ftime);
-#else
-	struct utimbuf ftime;
-
-	ftime.actime  = yst_atime;
-	ftime.modtime = yst_mtime;
+/*
+ * Statistics (option --stats): the counters are always maintained,
+ * that's one relaxed atomic increment per syscall. Option --stats
+ * prints them at the end as one line of JSON on stderr.
+ */
+enum { SYS_OPEN, SYS_CLOSE, SYS_MKDIR, SYS_SYMLINK, SYS_LINK, SYS_MKNOD,
+       SYS_WRITE, SYS_PREAD, SYS_CHOWN, SYS_CHMOD, SYS_UTIME,
+       SYS_FALLOCATE, SYS_TRUNCATE, SYS_URING, SYS_COUNT };
+
+/* phases: open and detect layout, index scan, extract, set times */
+enum { PH_OPEN, PH_SCAN, PH_EXTRACT, PH_FINISH, PH_COUNT };
+
+struct t_stats {
+	unsigned long sys[SYS_COUNT];	/* syscalls by kind */
+	unsigned long long bytes_written;
+	int      phase;			/* current phase, -1 before start */
+	double   phase_wall;		/* start of current phase */
+	double   phase_cpu;
+	double   wall[PH_COUNT];
+	double   cpu[PH_COUNT];
+};
+
+#define COUNT_SYS(kind)	\
+	__atomic_add_fetch(&ctx->stats.sys[kind], 1, __ATOMIC_RELAXED)
 
-	return utime(filename, &ftime);
-#endif
-}
+/*
+ * Per-image state. Each thread works on the image its ctx points to,
+ * that's main_ctx unless a batch worker (option --batch) switched it.
+ */
+struct t_context {
+	const char *name;		/* image file name */
+	int      img_file;
+	yaffs_image *img;		/* the image, see libunyaffs.h */
+	int      root_fd;		/* base dir of the extracted files */
+	char    *out_dir;		/* batch mode: name of the base dir */
+	char    *index_name;		/* index file (option -i) */
+
+	struct t_dir_cache dir_cache[DIR_CACHE_SIZE];
+	unsigned long dir_cache_clock;
+	pthread_mutex_t dir_cache_lock;
+
+	object **idx_list;		/* indexed objects in image order */
+	int      idx_count;
+	int      idx_alloc;
+	object **file_list;		/* regular files, largest first */
+	int      file_count;
+	int      file_next;
+
+	unsigned long objects;		/* extracted objects and file bytes, */
+	unsigned long long bytes;	/* summary of batch mode */
+	struct t_stats stats;
+	jmp_buf *fail;			/* batch mode: fatal errors end the image */
+};
+
+struct t_context main_ctx = {
+	.img_file = -1,
+	.root_fd = AT_FDCWD,
+	.dir_cache_lock = PTHREAD_MUTEX_INITIALIZER,
+	.stats.phase = -1,
+};
+__thread struct t_context *ctx = &main_ctx;
 
-/* error reporting function, similar to GNU error() */
+/*
+ * error reporting function, similar to GNU error(). In batch mode
+ * the messages get the image name, and a fatal error only stops
+ * the current image.
+ */
 static void prt_err(int status, int errnum, const char *format, ...) {
 	va_list varg;
 
 	va_start(varg, format);
 	fflush(stdout);
+	flockfile(stderr);
+	if (ctx->fail != NULL)
+		fprintf(stderr, "%s: ", ctx->name);
 	vfprintf(stderr, format, varg);
 	if (errnum != 0)
 		fprintf(stderr, ": %s", strerror(errnum));
 	fprintf(stderr, "\n");
+	funlockfile(stderr);
 	va_end(varg);
 
-	if (status != 0)
+	if (status != 0) {
+		if (ctx->fail != NULL)
+			longjmp(*ctx->fail, status);
 		exit(status);
+	}
 }
 
-/* read function, which handles partial and interrupted reads */
-ssize_t xread(int fd, void *buf, size_t len) {
+/* write function, which handles partial and interrupted writes */
+ssize_t xwrite(int fd, void *buf, size_t len) {
 	char *ptr = buf;
 	ssize_t offset, ret;
 
 	offset = 0;
 	while (offset < len) {
-		ret = read(fd, ptr+offset, len-offset);
+		COUNT_SYS(SYS_WRITE);
+		ret = write(fd, ptr+offset, len-offset);
 		if (ret < 0) {
 			if (errno != EAGAIN && errno != EINTR)
 				return -1;
@@ -152,23 +209,38 @@ ssize_t xread(int fd, void *buf, size_t len) {
 	return offset;
 }
 
-/* write function, which handles partial and interrupted writes */
-ssize_t xwrite(int fd, void *buf, size_t len) {
-	char *ptr = buf;
-	ssize_t offset, ret;
-
-	offset = 0;
-	while (offset < len) {
-		ret = write(fd, ptr+offset, len-offset);
+/*
+ * gathered write function, which handles partial and interrupted writes,
+ * a negative offset writes at the current file position
+ */
+ssize_t xpwritev(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+	ssize_t total, ret;
+
+	total = 0;
+	while (iovcnt > 0) {
+		COUNT_SYS(SYS_WRITE);
+		if (offset < 0)
+			ret = writev(fd, iov, iovcnt);
+		else
+			ret = pwritev(fd, iov, iovcnt, offset);
 		if (ret < 0) {
 			if (errno != EAGAIN && errno != EINTR)
 				return -1;
+			continue;
 		} else if (ret == 0)
 			break;
-		else
+		total += ret;
+		if (offset >= 0)
 			offset += ret;
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len; iov++; iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
 	}
-	return offset;
+	return total;
 }
 
 /*
@@ -200,113 +272,270 @@ static int mkdirpath(const char *name) {
 	return ret;
 }
 
-static void init_obj_list(void) {
-	object *obj;
-	unsigned idx;
+/*
+ * Selective extraction (--include, --exclude): the patterns are
+ * matched against the path name of each object. An object is selected,
+ * if it or one of its parent directories matches an include pattern
+ * (or there are none) and neither matches an exclude pattern.
+ * Parent directories, which aren't selected themselves, are only created
+ * when a selected object needs them.
+ */
+char **include_pat = NULL;
+int include_count = 0;
+char **exclude_pat = NULL;
+int exclude_count = 0;
+
+static void add_pattern(char ***list, int *count, const char *pat) {
+	while (pat[0] == '/' || (pat[0] == '.' && pat[1] == '/'))
+		pat += pat[0] == '/' ? 1 : 2;
+	*list = realloc(*list, (*count + 1) * sizeof(char *));
+	if (*list == NULL)
+		prt_err(1, 0, "Malloc pattern list failed.");
+	(*list)[(*count)++] = (char *)pat;
+}
 
-	for (idx = 0; idx < HASH_SIZE; idx++)
-		obj_list[idx] = NULL;
-	last_dir_id = 0;
+/* end of a [...] character class, a ] right after [ or [! is literal */
+static const char *class_end(const char *pat) {
+	pat++;
+	if (*pat == '!' || *pat == '^')
+		pat++;
+	return *pat == '\0' ? NULL : strchr(pat + 1, ']');
+}
+
+/*
+ * glob_match - shell wildcard matching of a path name,
+ * * and ? don't match a /, ** matches any number of path elements
+ */
+static int glob_match(const char *pat, const char *str) {
+	const char *cp, *end;
+	int neg, match;
+
+	while (*pat != '\0') {
+		if (pat[0] == '*' && pat[1] == '*') {
+			pat += 2;
+			if (*pat == '/' && glob_match(pat + 1, str))
+				return 1;
+			for (;; str++) {
+				if (glob_match(pat, str))
+					return 1;
+				if (*str == '\0')
+					return 0;
+			}
+		} else if (*pat == '*') {
+			pat++;
+			for (;; str++) {
+				if (glob_match(pat, str))
+					return 1;
+				if (*str == '\0' || *str == '/')
+					return 0;
+			}
+		} else if (*pat == '?') {
+			if (*str == '\0' || *str == '/')
+				return 0;
+		} else if (*pat == '[' && (end = class_end(pat)) != NULL) {
+			if (*str == '\0' || *str == '/')
+				return 0;
+			cp = pat + 1;
+			neg = *cp == '!' || *cp == '^';
+			if (neg)
+				cp++;
+			match = 0;
+			for (; cp < end; cp++) {
+				if (cp[1] == '-' && cp + 2 < end) {
+					if ((unsigned char)*str >= (unsigned char)cp[0] &&
+					    (unsigned char)*str <= (unsigned char)cp[2])
+						match = 1;
+					cp += 2;
+				} else if (*cp == *str)
+					match = 1;
+			}
+			if (match == neg)
+				return 0;
+			pat = end;
+		} else {
+			if (*pat == '\\' && pat[1] != '\0')
+				pat++;
+			if (*pat != *str)
+				return 0;
+		}
+		pat++; str++;
+	}
+	return *str == '\0';
+}
 
-	obj = malloc(offsetof(object, path_name) + 2);
-	if (obj == NULL)
-		prt_err(1, 0, "Malloc struct object failed.");
+static int match_any(char **list, int count, const char *path) {
+	int i;
 
-	obj->id = YAFFS_OBJECTID_ROOT;
-	obj->type = YAFFS_OBJECT_TYPE_DIRECTORY;
-	obj->prev_dir_id = 0;
-	obj->atime = obj->mtime = 0;
-	strcpy(obj->path_name, ".");
-	idx = obj->id % HASH_SIZE;
-	obj->next = obj_list[idx];
-	obj_list[idx] = obj;
+	for (i = 0; i < count; i++)
+		if (glob_match(list[i], path))
+			return 1;
+	return 0;
 }
 
-static object *get_object(unsigned id) {
-	object *obj;
+/* inherit the selection of the parent and match the patterns */
+static void select_object(object *obj) {
+	const char *path;
 
-	obj = obj_list[id % HASH_SIZE];
-	while (obj != NULL && obj->id != id)
-		obj = obj->next;
-	return obj;
+	obj->flags = obj->parent->flags & (OBJ_INCLUDED | OBJ_EXCLUDED);
+	if (include_count == 0 && exclude_count == 0)
+		return;
+	path = yaffs_path(obj);
+	if (!(obj->flags & OBJ_INCLUDED) &&
+	    match_any(include_pat, include_count, path))
+		obj->flags |= OBJ_INCLUDED;
+	if (!(obj->flags & OBJ_EXCLUDED) &&
+	    match_any(exclude_pat, exclude_count, path))
+		obj->flags |= OBJ_EXCLUDED;
 }
 
-static object *add_object(yaffs_ObjectHeader *oh, yaffs_PackedTags2 *pt) {
-	object *obj, *parent;
-	unsigned idx;
+static inline int obj_selected(object *obj) {
+	return obj->parent == NULL ||
+	       ((include_count == 0 || (obj->flags & OBJ_INCLUDED)) &&
+	        !(obj->flags & OBJ_EXCLUDED));
+}
 
-	obj = get_object(pt->t.objectId);
-	if (pt->t.objectId == YAFFS_OBJECTID_ROOT) {
-		if (obj == NULL)
-			prt_err(1, 0, "Missing root object");
-		if (oh->type != YAFFS_OBJECT_TYPE_DIRECTORY)
-			prt_err(1, 0, "Root object must be directory");
-		if (last_dir_id == 0)
-			last_dir_id = YAFFS_OBJECTID_ROOT;
-	} else {
-		if (oh->type != YAFFS_OBJECT_TYPE_FILE &&
-		    oh->type != YAFFS_OBJECT_TYPE_DIRECTORY &&
-		    oh->type != YAFFS_OBJECT_TYPE_SYMLINK &&
-		    oh->type != YAFFS_OBJECT_TYPE_HARDLINK &&
-		    oh->type != YAFFS_OBJECT_TYPE_SPECIAL &&
-		    oh->type != YAFFS_OBJECT_TYPE_UNKNOWN)
-			prt_err(1, 0, "Illegal type %d in object %u (%s)",
-			        oh->type, pt->t.objectId, oh->name);
-		if (oh->name[0] == '\0' || strchr(oh->name, '/') != NULL ||
-		    strcmp(oh->name, ".") == 0 || strcmp(oh->name, "..") == 0)
-			prt_err(1, 0, "Illegal file name %s in object %u",
-			        oh->name, pt->t.objectId);
-		if (obj != NULL)
-			prt_err(1, 0, "Duplicate objectId %u", pt->t.objectId);
-		parent = get_object(oh->parentObjectId);
-		if (parent == NULL)
-			prt_err(1, 0, "Invalid parentObjectId %u in object %u (%s)",
-	        		oh->parentObjectId, pt->t.objectId, oh->name);
-		if (parent->type != YAFFS_OBJECT_TYPE_DIRECTORY)
-			prt_err(1, ENOTDIR, "File %s can't be created in %s",
-	        		oh->name, parent->path_name);
-		obj = malloc(offsetof(object, path_name) +
-		             strlen(parent->path_name) + strlen(oh->name) + 2);
-		if (obj == NULL)
-			prt_err(1, 0, "Malloc struct object failed.");
-
-		obj->id = pt->t.objectId;
-		obj->type = oh->type;
-		if (obj->type == YAFFS_OBJECT_TYPE_DIRECTORY) {
-			obj->prev_dir_id = last_dir_id;
-			last_dir_id = obj->id;
-		} else
-			obj->prev_dir_id = 0;
-		if (strcmp(parent->path_name, ".") == 0) {
-			strcpy(obj->path_name, oh->name);
-		} else {
-			strcpy(obj->path_name, parent->path_name);
-			strcat(obj->path_name, "/");
-			strcat(obj->path_name, oh->name);
+/* release a directory fd, close it if it isn't cached */
+static void dir_release_locked(int fd) {
+	int i;
+
+	if (fd == ctx->root_fd)
+		return;
+	for (i = 0; i < DIR_CACHE_SIZE; i++)
+		if (ctx->dir_cache[i].fd == fd && ctx->dir_cache[i].refs > 0)
+			break;
+	if (i < DIR_CACHE_SIZE)
+		ctx->dir_cache[i].refs--;
+	else {
+		COUNT_SYS(SYS_CLOSE);
+		close(fd);
+	}
+}
+
+/*
+ * Cache of open directory file descriptors, so that all file system
+ * operations can use the *at() functions relative to the parent
+ * directory instead of resolving the full path name every time.
+ * The least recently used unreferenced entry gets replaced. If all
+ * entries are referenced (by other threads), the fd stays uncached
+ * and dir_close() closes it.
+ */
+static int dir_open_locked(object *dir) {
+	struct t_dir_cache *ent, *victim;
+	int i, pfd, fd;
+
+	if (dir == NULL || dir->id == YAFFS_OBJECTID_ROOT)
+		return ctx->root_fd;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		ent = &ctx->dir_cache[i];
+		if (ent->refs >= 0 && ent->id == dir->id) {
+			ent->refs++;
+			ent->used = ++ctx->dir_cache_clock;
+			return ent->fd;
 		}
-		idx = obj->id % HASH_SIZE;
-		obj->next = obj_list[idx];
-		obj_list[idx] = obj;
 	}
 
-	obj->atime = oh->yst_atime;
-	obj->mtime = oh->yst_mtime;
+	pfd = dir_open_locked(dir->parent);
+	COUNT_SYS(SYS_OPEN);
+	fd = openat(pfd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	i = errno;
+	dir_release_locked(pfd);
+	if (fd < 0) {			/* fatal, release the lock first */
+		pthread_mutex_unlock(&ctx->dir_cache_lock);
+		prt_err(1, i, "Can't open directory %s", yaffs_path(dir));
+	}
 
-	return obj;
+	/* after opening the parents, which may have taken entries */
+	victim = NULL;
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		ent = &ctx->dir_cache[i];
+		if (ent->refs <= 0 && (victim == NULL || ent->used < victim->used))
+			victim = ent;
+	}
+	if (victim != NULL) {			/* otherwise uncached */
+		if (victim->refs == 0) {
+			COUNT_SYS(SYS_CLOSE);
+			close(victim->fd);
+		}
+		victim->id = dir->id;
+		victim->fd = fd;
+		victim->refs = 1;
+		victim->used = ++ctx->dir_cache_clock;
+	}
+	return fd;
+}
+
+/* get an fd of a directory object, must be released with dir_close() */
+static int dir_open(object *dir) {
+	int fd;
+
+	pthread_mutex_lock(&ctx->dir_cache_lock);
+	fd = dir_open_locked(dir);
+	pthread_mutex_unlock(&ctx->dir_cache_lock);
+	return fd;
+}
+
+static void dir_close(int fd) {
+	if (fd == ctx->root_fd)
+		return;
+	pthread_mutex_lock(&ctx->dir_cache_lock);
+	dir_release_locked(fd);
+	pthread_mutex_unlock(&ctx->dir_cache_lock);
+}
+
+static void init_dir_cache(void) {
+	int i;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		ctx->dir_cache[i].refs = -1;		/* unused */
+		ctx->dir_cache[i].fd = -1;
+		ctx->dir_cache[i].used = 0;
+	}
+}
+
+static void flush_dir_cache(void) {
+	int i;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (ctx->dir_cache[i].refs >= 0) {
+			COUNT_SYS(SYS_CLOSE);
+			close(ctx->dir_cache[i].fd);
+		}
+		ctx->dir_cache[i].refs = -1;
+		ctx->dir_cache[i].fd = -1;
+	}
+}
+
+int set_utime(int dir_fd, const char *name, __u32 yst_atime, __u32 yst_mtime) {
+	struct timespec ftime[2];
+
+	ftime[0].tv_sec  = yst_atime;
+	ftime[0].tv_nsec = 0;
+	ftime[1].tv_sec  = yst_mtime;
+	ftime[1].tv_nsec = 0;
+
+	COUNT_SYS(SYS_UTIME);
+	return utimensat(dir_fd, name, ftime, AT_SYMLINK_NOFOLLOW);
 }
 
 void set_dirs_utime(void) {
 	unsigned id;
 	object *obj;
-
-	id = last_dir_id;
-	while (id != 0 && (obj = get_object(id)) != NULL) {
-		set_utime(obj->path_name, obj->atime, obj->mtime);
+	int dir_fd;
+
+	id = ctx->img->last_dir_id;
+	while (id != 0 && (obj = yaffs_get_object(ctx->img, id)) != NULL) {
+		if (obj->flags & OBJ_CREATED) {
+			dir_fd = dir_open(obj->parent);
+			set_utime(dir_fd, obj->name, obj->atime, obj->mtime);
+			dir_close(dir_fd);
+		}
 		id = obj->prev_dir_id;
 	}
+	flush_dir_cache();
 }
 
-static void prt_node(char *name, yaffs_ObjectHeader *oh) {
+static void prt_node(const char *name, yaffs_ObjectHeader *oh) {
 	object *eq_obj;
 	struct tm tm;
 	time_t mtime;
@@ -327,7 +556,7 @@ static void prt_node(char *name, yaffs_ObjectHeader *oh) {
 		case YAFFS_OBJECT_TYPE_DIRECTORY:	type = 'd'; break;
 		case YAFFS_OBJECT_TYPE_SYMLINK:		type = 'l'; break;
 		case YAFFS_OBJECT_TYPE_HARDLINK:	type = 'h';
-			eq_obj = get_object(oh->equivalentObjectId);
+			eq_obj = yaffs_get_object(ctx->img, oh->equivalentObjectId);
 			mtime = eq_obj != NULL ? eq_obj->mtime : 0;
 			mode = STD_PERMS;
 			break;
@@ -378,238 +607,1931 @@ static void prt_node(char *name, yaffs_ObjectHeader *oh) {
 		if (eq_obj == NULL)
 			printf(" -> !!! Invalid !!!");
 		else
-			printf(" -> /%s", eq_obj->path_name);
+			printf(" -> /%s", yaffs_path(eq_obj));
 	} else if (oh->type == YAFFS_OBJECT_TYPE_SYMLINK) {
 		printf(" -> %s", oh->alias);
 	}
 	printf("\n");
 }
 
-int read_chunk(void);
+/* library errors are fatal */
+static void img_fail(void) {
+	prt_err(1, ctx->img->err_errno, "%s", yaffs_errmsg(ctx->img));
+}
 
-void process_chunk(void) {
-	yaffs_ObjectHeader oh;
-	yaffs_PackedTags2 *pt;
-	object *obj, *eq_obj;
-	int out_file, remain, s;
+static void img_warn(yaffs_image *image, const char *msg) {
+	prt_err(0, 0, "Warning: %s", msg);
+}
+
+/*
+ * read_header - get the object header of an indexed object,
+ * buf is used when the image isn't mapped
+ */
+static yaffs_ObjectHeader *read_header(object *obj, yaffs_ObjectHeader *buf) {
+	yaffs_ObjectHeader *oh;
+
+	if ((oh = yaffs_read_header(ctx->img, obj, buf)) == NULL)
+		img_fail();
+	return oh;
+}
 
-	oh = *(yaffs_ObjectHeader *)chunk_data;
-	pt = (yaffs_PackedTags2 *)spare_data;
+/*
+ * is_zero - check if a buffer contains only zero bytes,
+ * comparing it with itself shifted by one lets memcmp() do the
+ * (vectorized) work
+ */
+static int is_zero(const unsigned char *buf, size_t len) {
+	return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
 
-	if (pt->t.byteCount == 0xffffffff)	/* empty object */
+/*
+ * preallocate - reserve the disk space of a file in advance, which
+ * keeps its extents together when several files are written at once.
+ * Just an optimization, so errors are ignored; once the file system
+ * turns out not to support it (EOPNOTSUPP, ENOSYS), it isn't tried
+ * again.
+ */
+static int prealloc_unsupported;
+
+static void preallocate(int fd, off_t size) {
+#ifdef __linux__
+	if (opt_prealloc && size > ctx->img->chunk_size &&
+	    !__atomic_load_n(&prealloc_unsupported, __ATOMIC_RELAXED)) {
+		COUNT_SYS(SYS_FALLOCATE);
+		if (fallocate(fd, 0, 0, size) < 0 &&
+		    (errno == EOPNOTSUPP || errno == ENOSYS))
+			__atomic_store_n(&prealloc_unsupported, 1, __ATOMIC_RELAXED);
+	}
+#endif
+}
+
+/*
+ * Optional io_uring backend (option -u) for the single threaded
+ * extraction: the gathered data writes and the close of the output
+ * files are queued as asynchronous requests and submitted in batches,
+ * so writing a small file costs no extra syscall at all. The chunk
+ * data must stay valid until the writes complete, so the ring is
+ * drained before the read buffer gets refilled. File times are set at
+ * the end, after all writes completed. Without kernel support the
+ * normal syscalls are used.
+ */
+#define URING_ENTRIES		  256
+
+int uring_fd = -1;
+
+#ifdef HAS_IO_URING
+struct t_uring_slot {
+	object *obj;
+	size_t  len;
+	int     next_free;
+	struct iovec iov[MAX_IOV];
+};
+
+struct {
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void    *sq_ring, *cq_ring;
+	size_t   sq_ring_size, cq_ring_size, sqes_size;
+	unsigned to_submit;
+	unsigned inflight;
+	struct t_uring_slot *slot;
+	int      free_slot;
+} uring;
+#endif
+
+object **utime_list = NULL;		/* files with deferred file times */
+int utime_count = 0;
+int utime_alloc = 0;
+
+#ifdef HAS_IO_URING
+/* submit queued requests and reap completions, waiting for min_complete */
+static void uring_enter(unsigned min_complete) {
+	struct io_uring_cqe *cqe;
+	struct t_uring_slot *sl;
+	unsigned head;
+	int ret;
+
+	do {
+		COUNT_SYS(SYS_URING);
+		ret = syscall(__NR_io_uring_enter, uring_fd, uring.to_submit,
+		              min_complete,
+		              min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		prt_err(1, errno, "io_uring_enter");
+	uring.to_submit -= ret < uring.to_submit ? ret : uring.to_submit;
+
+	head = *uring.cq_head;
+	while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &uring.cqes[head & *uring.cq_mask];
+		sl = &uring.slot[cqe->user_data];
+		if (cqe->res < 0)
+			prt_err(1, -cqe->res, "Can't write to %s", yaffs_path(sl->obj));
+		if (cqe->res != sl->len)
+			prt_err(1, ENOSPC, "Can't write to %s", yaffs_path(sl->obj));
+		sl->next_free = uring.free_slot;
+		uring.free_slot = sl - uring.slot;
+		uring.inflight--;
+		head++;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *uring_get_sqe(object *obj, size_t len, int *idx) {
+	struct io_uring_sqe *sqe;
+	struct t_uring_slot *sl;
+	unsigned tail;
+
+	while (uring.free_slot < 0)		/* all slots in flight */
+		uring_enter(1);
+	*idx = uring.free_slot;
+	sl = &uring.slot[*idx];
+	uring.free_slot = sl->next_free;
+	sl->obj = obj;
+	sl->len = len;
+
+	tail = *uring.sq_tail;
+	sqe = &uring.sqes[tail & *uring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = *idx;
+	uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+	return sqe;
+}
+
+static void uring_queue(void) {
+	__atomic_store_n(uring.sq_tail, *uring.sq_tail + 1, __ATOMIC_RELEASE);
+	uring.inflight++;
+	if (++uring.to_submit >= URING_ENTRIES / 2)
+		uring_enter(0);
+}
+
+static void uring_writev(int fd, object *obj, struct iovec *iov, int iov_cnt,
+                         off_t offset, size_t len) {
+	struct io_uring_sqe *sqe;
+	int idx;
+
+	sqe = uring_get_sqe(obj, len, &idx);
+	memcpy(uring.slot[idx].iov, iov, iov_cnt * sizeof(struct iovec));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd     = fd;
+	sqe->addr   = (unsigned long)uring.slot[idx].iov;
+	sqe->len    = iov_cnt;
+	sqe->off    = offset;
+	uring_queue();
+}
+
+static void uring_close(int fd, object *obj) {
+	struct io_uring_sqe *sqe;
+	int idx;
+
+	sqe = uring_get_sqe(obj, 0, &idx);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd     = fd;
+	uring_queue();
+}
+
+/* wait until all queued requests are completed */
+static void uring_drain(void) {
+	while (uring_fd >= 0 && (uring.inflight > 0 || uring.to_submit > 0))
+		uring_enter(uring.inflight);
+}
+
+static void uring_exit(void) {
+	if (uring_fd < 0)
 		return;
-	else if (pt->t.byteCount != 0xffff) {	/* not a new object */
-		prt_err(0, 0, "Warning: Invalid header at chunk #%d, skipping...",
-		        chunk_no);
-		if (++warn_count >= MAX_WARN)
-			prt_err(1, 0, "Giving up");
+	munmap(uring.sqes, uring.sqes_size);
+	if (uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_size);
+	munmap(uring.sq_ring, uring.sq_ring_size);
+	close(uring_fd);
+	free(uring.slot);
+	uring_fd = -1;
+}
+
+/* set up the ring, returns 0 if io_uring (with IORING_OP_CLOSE) isn't usable */
+static int uring_init(void) {
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	unsigned char *sq, *cq;
+	int i, ok;
+
+	memset(&p, 0, sizeof(p));
+	uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (uring_fd < 0)
+		return 0;
+
+	uring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_size = p.cq_off.cqes +
+	                     p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring.cq_ring_size > uring.sq_ring_size)
+			uring.sq_ring_size = uring.cq_ring_size;
+		uring.cq_ring_size = uring.sq_ring_size;
+	}
+	uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+	if (uring.sq_ring == MAP_FAILED)
+		{ close(uring_fd); uring_fd = -1; return 0; }
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		uring.cq_ring = uring.sq_ring;
+	else {
+		uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE, uring_fd,
+		                     IORING_OFF_CQ_RING);
+		if (uring.cq_ring == MAP_FAILED) {
+			munmap(uring.sq_ring, uring.sq_ring_size);
+			close(uring_fd); uring_fd = -1; return 0;
+		}
+	}
+	uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+	uring.slot = malloc(URING_ENTRIES * sizeof(struct t_uring_slot));
+	if (uring.sqes == MAP_FAILED || uring.slot == NULL) {
+		if (uring.sqes == MAP_FAILED)
+			uring.sqes_size = 0;
+		uring_exit();
+		return 0;
+	}
+
+	sq = uring.sq_ring;
+	cq = uring.cq_ring;
+	uring.sq_head  = (unsigned *)(sq + p.sq_off.head);
+	uring.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+	uring.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	uring.cq_head  = (unsigned *)(cq + p.cq_off.head);
+	uring.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+	uring.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+	uring.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	uring.to_submit = uring.inflight = 0;
+	for (i = 0; i < URING_ENTRIES; i++)
+		uring.slot[i].next_free = i + 1 < URING_ENTRIES ? i + 1 : -1;
+	uring.free_slot = 0;
+
+	/* IORING_OP_CLOSE needs linux 5.6, which also brought the probe */
+	ok = 0;
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (probe != NULL &&
+	    syscall(__NR_io_uring_register, uring_fd, IORING_REGISTER_PROBE,
+	            probe, 256) >= 0 &&
+	    probe->last_op >= IORING_OP_CLOSE &&
+	    (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED) &&
+	    (probe->ops[IORING_OP_WRITEV].flags & IO_URING_OP_SUPPORTED))
+		ok = 1;
+	free(probe);
+	if (!ok)
+		uring_exit();
+	return ok;
+}
+#else
+static void uring_writev(int fd, object *obj, struct iovec *iov, int iov_cnt,
+                         off_t offset, size_t len) { }
+static void uring_close(int fd, object *obj) { }
+static void uring_drain(void) { }
+static void uring_exit(void) { }
+static int  uring_init(void) { return 0; }
+#endif
+
+/* remember a file, whose times are set after all writes completed */
+static void defer_utime(object *obj) {
+	if (utime_count >= utime_alloc) {
+		utime_alloc = utime_alloc ? 2 * utime_alloc : 1024;
+		utime_list = realloc(utime_list, utime_alloc * sizeof(object *));
+		if (utime_list == NULL)
+			prt_err(1, 0, "Malloc utime list failed.");
+	}
+	utime_list[utime_count++] = obj;
+}
+
+void set_files_utime(void) {
+	object *obj;
+	int i, dir_fd;
+
+	uring_drain();
+	for (i = 0; i < utime_count; i++) {
+		obj = utime_list[i];
+		dir_fd = dir_open(obj->parent);
+		set_utime(dir_fd, obj->name, obj->atime, obj->mtime);
+		dir_close(dir_fd);
+	}
+	free(utime_list);
+	utime_list = NULL;
+	utime_count = utime_alloc = 0;
+}
+
+/* write the gathered chunk payloads at the current output position */
+static void flush_data(int out_file, object *obj, struct iovec *iov,
+                       int *iov_cnt, off_t *out_pos) {
+	ssize_t len;
+	int i;
+
+	if (*iov_cnt == 0)
 		return;
+	for (i = 0, len = 0; i < *iov_cnt; i++)
+		len += iov[i].iov_len;
+	__atomic_add_fetch(&ctx->stats.bytes_written, len, __ATOMIC_RELAXED);
+	if (out_stream) {
+		if (xpwritev(out_file, iov, *iov_cnt, -1) != len)
+			prt_err(1, errno, tar_fd >= 0 ? "Can't write archive" :
+			                                "Can't write to standard output");
+		if (tar_fd >= 0)
+			tar_pos += len;
+	} else if (uring_fd >= 0)
+		uring_writev(out_file, obj, iov, *iov_cnt, *out_pos, len);
+	else if (xpwritev(out_file, iov, *iov_cnt, *out_pos) != len)
+		prt_err(1, errno, "Can't write to %s", yaffs_path(obj));
+	*out_pos += len;
+	*iov_cnt = 0;
+}
+
+/*
+ * Write state of the thread: the chunk buffer for reading the image is
+ * kept for the following files, and the file being written is known,
+ * so both are released when a fatal error ends an image in batch mode.
+ */
+__thread unsigned char *chunk_buf = NULL;
+__thread size_t chunk_buf_size = 0;
+__thread int out_fd = -1;
+
+static unsigned char *get_chunk_buf(size_t size) {
+	if (size > chunk_buf_size) {
+		free(chunk_buf);
+		chunk_buf_size = 0;
+		if ((chunk_buf = malloc(size)) == NULL)
+			prt_err(1, 0, "Malloc chunk buffer failed.");
+		chunk_buf_size = size;
 	}
+	return chunk_buf;
+}
 
-	obj = add_object(&oh, pt);
+static void release_write_state(void) {
+	free(chunk_buf);
+	chunk_buf = NULL;
+	chunk_buf_size = 0;
+	if (out_fd >= 0)
+		close(out_fd);
+	out_fd = -1;
+}
 
-	/* listing */
-	if (opt_verbose)
-		prt_node(obj->path_name, &oh);
-	else if (opt_list)
-		printf("%s\n", obj->path_name);
-	if (opt_list) {
-		if (oh.type == YAFFS_OBJECT_TYPE_FILE) {
-			remain = oh.fileSize;	/* skip over data chunks */
-			while(remain > 0) {
-				if (!read_chunk())
-					prt_err(1, 0, "Broken image file");
-				remain -= pt->t.byteCount;
+/*
+ * write_mapped - write a file found by the full scan (option -f) or the
+ * chunk map scan (option -m) from its chunk map, in chunkId order.
+ * Missing chunks become holes, or
+ * zeros in an archive or on standard output. Chunks following each
+ * other in the image are read with one pread().
+ */
+static void write_mapped(int out_file, object *obj, off_t size) {
+	static const unsigned char zero_chunk[YAFFS_MAX_CHUNK_SIZE];
+	struct iovec iov[MAX_IOV];
+	struct yaffs_chunk *ch, *end;
+	const unsigned char *cdata;
+	unsigned char *cbuf;
+	off_t out_pos, done, off;
+	int s, holes, batch, iov_cnt, buf_cnt, buf_idx;
+	size_t len;
+
+	len = ctx->img->chunk_size + ctx->img->spare_size;
+	batch = WRITE_BUF_SIZE / ctx->img->chunk_size;
+	if (batch > MAX_IOV) batch = MAX_IOV;
+
+	cbuf = ctx->img->map == NULL ? get_chunk_buf(batch * len) : NULL;
+
+	ch = obj->chunks;
+	end = ch + obj->chunk_count;
+	out_pos = done = 0;		/* written and queued bytes */
+	iov_cnt = buf_cnt = buf_idx = 0;
+	holes = 0;
+	if (!opt_sparse && !out_stream)
+		preallocate(out_file, size);
+	while (done < size) {
+		while (ch < end && ch->pos < 0)	/* missing in a dense map */
+			ch++;
+		off = ch < end ? (off_t)(ch->chunk_id - 1) * ctx->img->chunk_size : size;
+		if (off > size)
+			off = size;
+		if (off > done) {		/* missing chunk */
+			s = off - done < ctx->img->chunk_size ? off - done
+			                                      : ctx->img->chunk_size;
+			if (out_stream) {
+				iov[iov_cnt].iov_base = (void *)zero_chunk;
+				iov[iov_cnt].iov_len  = s;
+				if (++iov_cnt >= batch)
+					flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+			} else {
+				flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+				out_pos += s;
+				holes = 1;
+			}
+			done += s;
+			continue;
+		}
+
+		if (ctx->img->map != NULL)
+			cdata = ctx->img->map + ch->pos;
+		else {
+			if (buf_idx >= buf_cnt) {	/* read the next run of chunks */
+				flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+				for (buf_cnt = 1; buf_cnt < batch && ch + buf_cnt < end &&
+				     ch[buf_cnt].pos == ch->pos + buf_cnt * (off_t)len; buf_cnt++)
+					;
+				COUNT_SYS(SYS_PREAD);
+				if (pread(ctx->img->fd, cbuf, buf_cnt * len, ch->pos) !=
+				    buf_cnt * len)
+					prt_err(1, errno, "Read image file");
+				buf_idx = 0;
 			}
+			cdata = cbuf + buf_idx++ * len;
 		}
+		s = size - done < ch->n_bytes ? size - done : ch->n_bytes;
+		if (opt_sparse && !out_stream && is_zero(cdata, s)) {	/* leave a hole */
+			flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+			out_pos += s;
+			holes = 1;
+		} else if (s > 0) {
+			iov[iov_cnt].iov_base = (void *)cdata;
+			iov[iov_cnt].iov_len  = s;
+			if (++iov_cnt >= batch)
+				flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+		}
+		done += s;
+		ch++;
+	}
+	flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+	if (holes) {
+		COUNT_SYS(SYS_TRUNCATE);
+		if (ftruncate(out_file, size) < 0)
+			prt_err(1, errno, "Can't write to %s", yaffs_path(obj));
+	}
+}
+
+/*
+ * write_data - write the data chunks of a file, either the chunks
+ * following in the image stream or (indexed) the chunks at the
+ * image position following the file header.
+ * As long as the chunk data stays valid (mapped image, read buffer
+ * or indexed block read) the payloads of many chunks are written with one
+ * pwritev(), skipping the spare areas.
+ */
+static void write_data(int out_file, object *obj, yaffs_ObjectHeader *oh,
+                       int indexed) {
+	struct iovec iov[MAX_IOV];
+	yaffs_PackedTags2 *pt;
+	const unsigned char *cdata;
+	unsigned char *cbuf;
+	off_t pos, out_pos;
+	int remain, s, holes, batch, iov_cnt, buf_cnt, buf_idx, ret;
+	size_t len;
+
+	if (ctx->img->chunk_maps) {
+		write_mapped(out_file, obj, oh->fileSize);
 		return;
 	}
 
-	switch(oh.type) {
+	len = ctx->img->chunk_size + ctx->img->spare_size;
+	batch = WRITE_BUF_SIZE / ctx->img->chunk_size;
+	if (batch > MAX_IOV) batch = MAX_IOV;
+
+	cbuf = indexed && ctx->img->map == NULL ? get_chunk_buf(batch * len)
+	                                        : NULL;
+
+	pos = obj->hdr_pos + len;		/* first data chunk */
+	out_pos = 0;
+	iov_cnt = buf_cnt = buf_idx = 0;
+	remain = oh->fileSize;
+	holes = 0;
+	if (!opt_sparse && !out_stream)
+		preallocate(out_file, remain);
+	while(remain > 0) {
+		if (!indexed) {
+			if (!yaffs_chunk_buffered(ctx->img))	/* read buffer gets refilled */
+				flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+			if ((ret = yaffs_next_data(ctx->img, &cdata, &s)) < 0)
+				img_fail();
+			if (ret == 0)
+				prt_err(1, 0, "Broken image file");
+		} else if (ctx->img->map != NULL) {
+			cdata = ctx->img->map + pos;
+			pos += len;
+		} else {
+			if (buf_idx >= buf_cnt) {	/* read next block of chunks */
+				flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+				buf_cnt = (remain - 1) / ctx->img->chunk_size + 1;
+				if (buf_cnt > batch) buf_cnt = batch;
+				COUNT_SYS(SYS_PREAD);
+				if (pread(ctx->img->fd, cbuf, buf_cnt * len, pos) !=
+				    buf_cnt * len)
+					prt_err(1, errno, "Read image file");
+				pos += buf_cnt * len;
+				buf_idx = 0;
+			}
+			cdata = cbuf + buf_idx++ * len;
+		}
+		if (indexed) {
+			pt = (yaffs_PackedTags2 *)(cdata + ctx->img->chunk_size);
+			s = (remain < pt->t.byteCount) ? remain : pt->t.byteCount;
+		}
+		if (opt_sparse && !out_stream && is_zero(cdata, s)) {	/* leave a hole */
+			flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+			out_pos += s;
+			holes = 1;
+		} else {
+			iov[iov_cnt].iov_base = (void *)cdata;
+			iov[iov_cnt].iov_len  = s;
+			if (++iov_cnt >= batch)
+				flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+		}
+		remain -= s;
+	}
+	flush_data(out_file, obj, iov, &iov_cnt, &out_pos);
+	if (holes) {
+		COUNT_SYS(SYS_TRUNCATE);
+		if (ftruncate(out_file, oh->fileSize) < 0)
+			prt_err(1, errno, "Can't write to %s", yaffs_path(obj));
+	}
+}
+
+/*
+ * extract_object - create an object in the file system,
+ * for regular files including the data
+ */
+static void extract_object(object *obj, yaffs_ObjectHeader *oh, int indexed) {
+	object *eq_obj;
+	const char *name;
+	char *link_path;
+	int dir_fd, eq_fd, out_file;
+
+	dir_fd = dir_open(obj->parent);
+	name = obj->name;
+
+	switch(oh->type) {
 		case YAFFS_OBJECT_TYPE_FILE:
-			remain = oh.fileSize;
-			out_file = creat(obj->path_name, oh.yst_mode & STD_PERMS);
+			COUNT_SYS(SYS_OPEN);
+			out_file = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC,
+			                  oh->yst_mode & STD_PERMS);
 			if (out_file < 0)
-				prt_err(1, errno, "Can't create file %s", obj->path_name);
-			while(remain > 0) {
-				if (!read_chunk())
-					prt_err(1, 0, "Broken image file");
-				s = (remain < pt->t.byteCount) ? remain : pt->t.byteCount;
-				if (xwrite(out_file, chunk_data, s) < 0)
-					prt_err(1, errno, "Can't write to %s", obj->path_name);
-				remain -= s;
+				prt_err(1, errno, "Can't create file %s", yaffs_path(obj));
+			out_fd = out_file;
+			write_data(out_file, obj, oh, indexed);
+			COUNT_SYS(SYS_CHOWN);
+			fchown(out_file, oh->yst_uid, oh->yst_gid);
+			if ((oh->yst_mode & EXTRA_PERMS) != 0) {
+				uring_drain();	/* a write would clear them */
+				COUNT_SYS(SYS_CHMOD);
+				if (fchmod(out_file, oh->yst_mode) < 0)
+					prt_err(0, errno, "Warning: Can't chmod %s", yaffs_path(obj));
+			}
+			out_fd = -1;
+			if (uring_fd >= 0)
+				uring_close(out_file, obj);
+			else {
+				COUNT_SYS(SYS_CLOSE);
+				close(out_file);
 			}
-			close(out_file);
-			lchown(obj->path_name, oh.yst_uid, oh.yst_gid);
-			if ((oh.yst_mode & EXTRA_PERMS) != 0 &&
-			    chmod(obj->path_name, oh.yst_mode) < 0)
-				prt_err(0, errno, "Warning: Can't chmod %s", obj->path_name);
 			break;
 		case YAFFS_OBJECT_TYPE_SYMLINK:
-			if (symlink(oh.alias, obj->path_name) < 0)
-				prt_err(1, errno, "Can't create symlink %s", obj->path_name);
-			lchown(obj->path_name, oh.yst_uid, oh.yst_gid);
+			COUNT_SYS(SYS_SYMLINK);
+			if (symlinkat(oh->alias, dir_fd, name) < 0)
+				prt_err(1, errno, "Can't create symlink %s", yaffs_path(obj));
+			COUNT_SYS(SYS_CHOWN);
+			fchownat(dir_fd, name, oh->yst_uid, oh->yst_gid,
+			         AT_SYMLINK_NOFOLLOW);
 			break;
 		case YAFFS_OBJECT_TYPE_DIRECTORY:
-			if (pt->t.objectId != YAFFS_OBJECTID_ROOT &&
-			    mkdir(obj->path_name, oh.yst_mode & STD_PERMS) < 0)
-					prt_err(1, errno, "Can't create directory %s", obj->path_name);
-			lchown(obj->path_name, oh.yst_uid, oh.yst_gid);
-			if ((pt->t.objectId == YAFFS_OBJECTID_ROOT ||
-			     (oh.yst_mode & EXTRA_PERMS) != 0) &&
-			    chmod(obj->path_name, oh.yst_mode) < 0)
-				prt_err(0, errno, "Warning: Can't chmod %s", obj->path_name);
+			if (obj->id != YAFFS_OBJECTID_ROOT) {
+				COUNT_SYS(SYS_MKDIR);
+				if (mkdirat(dir_fd, name, oh->yst_mode & STD_PERMS) < 0)
+					prt_err(1, errno, "Can't create directory %s", yaffs_path(obj));
+			}
+			obj->flags |= OBJ_CREATED;
+			COUNT_SYS(SYS_CHOWN);
+			fchownat(dir_fd, name, oh->yst_uid, oh->yst_gid,
+			         AT_SYMLINK_NOFOLLOW);
+			if (obj->id == YAFFS_OBJECTID_ROOT ||
+			    (oh->yst_mode & EXTRA_PERMS) != 0) {
+				COUNT_SYS(SYS_CHMOD);
+				if (fchmodat(dir_fd, name, oh->yst_mode, 0) < 0)
+					prt_err(0, errno, "Warning: Can't chmod %s", yaffs_path(obj));
+			}
 			break;
 		case YAFFS_OBJECT_TYPE_HARDLINK:
-			eq_obj = get_object(oh.equivalentObjectId);
+			eq_obj = yaffs_get_object(ctx->img, oh->equivalentObjectId);
 			if (eq_obj == NULL)
 				prt_err(1, 0, "Invalid equivalentObjectId %u in object %u (%s)",
-				        oh.equivalentObjectId, pt->t.objectId, oh.name);
-			if (link(eq_obj->path_name, obj->path_name) < 0)
-				prt_err(1, errno, "Can't create hardlink %s", obj->path_name);
+				        oh->equivalentObjectId, obj->id, oh->name);
+			if (!obj_selected(eq_obj)) {
+				/* yaffs_path() reuses its buffer */
+				link_path = strdup(yaffs_path(obj));
+				prt_err(0, 0, "Warning: Can't create hardlink %s, %s is not extracted",
+				        link_path != NULL ? link_path : name, yaffs_path(eq_obj));
+				free(link_path);
+				break;
+			}
+			eq_fd = dir_open(eq_obj->parent);
+			COUNT_SYS(SYS_LINK);
+			if (linkat(eq_fd, eq_obj->name, dir_fd, name, 0) < 0)
+				prt_err(1, errno, "Can't create hardlink %s", yaffs_path(obj));
+			dir_close(eq_fd);
 			break;
 		case YAFFS_OBJECT_TYPE_SPECIAL:
-			if (mknod(obj->path_name, oh.yst_mode, oh.yst_rdev) < 0) {
+			COUNT_SYS(SYS_MKNOD);
+			if (mknodat(dir_fd, name, oh->yst_mode, oh->yst_rdev) < 0) {
 				if (errno == EPERM || errno == EINVAL)
-					prt_err(0, errno, "Warning: Can't create device %s", obj->path_name);
+					prt_err(0, errno, "Warning: Can't create device %s", yaffs_path(obj));
 				else
-					prt_err(1, errno, "Can't create device %s", obj->path_name);
+					prt_err(1, errno, "Can't create device %s", yaffs_path(obj));
 			}
-			lchown(obj->path_name, oh.yst_uid, oh.yst_gid);
+			COUNT_SYS(SYS_CHOWN);
+			fchownat(dir_fd, name, oh->yst_uid, oh->yst_gid,
+			         AT_SYMLINK_NOFOLLOW);
 			break;
 		case YAFFS_OBJECT_TYPE_UNKNOWN:
 			break;
 	}
 
 	/* set file date and time */
-	switch(oh.type) {
+	switch(oh->type) {
 		case YAFFS_OBJECT_TYPE_FILE:
+			if (uring_fd >= 0) {
+				defer_utime(obj);
+				break;
+			}
+			/* fall through */
 		case YAFFS_OBJECT_TYPE_SPECIAL:
-#ifdef HAS_LUTIMES
 		case YAFFS_OBJECT_TYPE_SYMLINK:
-#endif
-			set_utime(obj->path_name,
-			          oh.yst_atime, oh.yst_mtime);
+			set_utime(dir_fd, name, oh->yst_atime, oh->yst_mtime);
 			break;
 		case YAFFS_OBJECT_TYPE_DIRECTORY:
 		default:
 			break;
 	}
+
+	dir_close(dir_fd);
+	__atomic_add_fetch(&ctx->objects, 1, __ATOMIC_RELAXED);
+	if (oh->type == YAFFS_OBJECT_TYPE_FILE && oh->fileSize > 0)
+		__atomic_add_fetch(&ctx->bytes, oh->fileSize, __ATOMIC_RELAXED);
 }
 
+/*
+ * Archive output (option -o): instead of creating the objects in the
+ * file system, a POSIX ustar archive with pax extended headers (for
+ * long names, link targets and ids) is written.
+ */
+#define TAR_BLOCK		  512
+#define TAR_RECORD		(20*TAR_BLOCK)
+
+typedef struct {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} tar_header;
+
+static void tar_write(const void *buf, size_t len) {
+	if (xwrite(tar_fd, (void *)buf, len) != len)
+		prt_err(1, errno, "Can't write archive");
+	tar_pos += len;
+	ctx->stats.bytes_written += len;
+}
 
-int read_chunk(void) {
-	ssize_t s, len, offset;
+static void tar_pad(void) {
+	static const char zero[TAR_BLOCK];
 
-	chunk_no++;
-	len = chunk_size + spare_size;
-	offset = 0;
-	memset(chunk_data, 0xff, sizeof(chunk_data));
+	if (tar_pos % TAR_BLOCK != 0)
+		tar_write(zero, TAR_BLOCK - tar_pos % TAR_BLOCK);
+}
+
+/* append a pax record "<len> <key>=<value>\n" */
+static void pax_add(char **pax, size_t *pax_len, const char *key,
+                    const char *value) {
+	size_t len, n;
 
-	if (buf_len > buf_idx) {		/* copy from buffer */
-		s = buf_len - buf_idx;
-		if (s > len) s = len;
-		memcpy(data, buffer+buf_idx, s);
-		buf_idx += s; offset += s;
+	n = strlen(key) + strlen(value) + 3;	/* " =\n" */
+	for (len = n + 1; len < n + 20; len++)	/* length includes itself */
+		if (snprintf(NULL, 0, "%zu", len) + n == len)
+			break;
+	*pax = realloc(*pax, *pax_len + len + 1);
+	if (*pax == NULL)
+		prt_err(1, 0, "Malloc pax header failed.");
+	sprintf(*pax + *pax_len, "%zu %s=%s\n", len, key, value);
+	*pax_len += len;
+}
+
+static void tar_entry(const char *path, const char *link, char type,
+                      yaffs_ObjectHeader *oh, off_t size) {
+	tar_header th, ph;
+	char *pax, num[24];
+	size_t pax_len, len, i;
+	unsigned sum;
+	const char *sep, *leaf;
+
+	memset(&th, 0, sizeof(th));
+	pax = NULL;
+	pax_len = 0;
+
+	len = strlen(path);
+	if (len <= sizeof(th.name))
+		memcpy(th.name, path, len);
+	else {				/* split into prefix and name */
+		sep = path + len - sizeof(th.name) - 1;
+		while (*sep != '\0' && *sep != '/')
+			sep++;
+		if (*sep == '/' && sep > path && sep - path <= sizeof(th.prefix) &&
+		    sep[1] != '\0') {
+			memcpy(th.prefix, path, sep - path);
+			memcpy(th.name, sep + 1, path + len - sep - 1);
+		} else {
+			pax_add(&pax, &pax_len, "path", path);
+			memcpy(th.name, path, sizeof(th.name));
+		}
+	}
+	if (link != NULL) {
+		len = strlen(link);
+		if (len > sizeof(th.linkname))
+			pax_add(&pax, &pax_len, "linkpath", link);
+		memcpy(th.linkname, link, len < sizeof(th.linkname) ? len : sizeof(th.linkname));
+	}
+	if (oh->yst_uid > 07777777) {
+		snprintf(num, sizeof(num), "%u", oh->yst_uid);
+		pax_add(&pax, &pax_len, "uid", num);
+	}
+	if (oh->yst_gid > 07777777) {
+		snprintf(num, sizeof(num), "%u", oh->yst_gid);
+		pax_add(&pax, &pax_len, "gid", num);
 	}
 
-	if (offset < len) {			/* read from file */
-		s = xread(img_file, data+offset, len-offset);
-		if (s < 0)
-			prt_err(1, errno, "Read image file");
-		offset += s;
+	if (pax != NULL) {		/* extended header first */
+		memset(&ph, 0, sizeof(ph));
+		leaf = strrchr(path, '/');
+		leaf = leaf != NULL && leaf[1] != '\0' ? leaf + 1 : path;
+		snprintf(ph.name, sizeof(ph.name), "PaxHeader/%.80s", leaf);
+		strcpy(ph.mode, "0000644");
+		strcpy(ph.uid, "0000000");
+		strcpy(ph.gid, "0000000");
+		snprintf(ph.size, sizeof(ph.size), "%011lo", (unsigned long)pax_len);
+		snprintf(ph.mtime, sizeof(ph.mtime), "%011lo", (unsigned long)oh->yst_mtime);
+		ph.typeflag = 'x';
+		memcpy(ph.magic, "ustar", 6);
+		memcpy(ph.version, "00", 2);
+		memset(ph.chksum, ' ', sizeof(ph.chksum));
+		for (i = 0, sum = 0; i < sizeof(ph); i++)
+			sum += ((unsigned char *)&ph)[i];
+		snprintf(ph.chksum, sizeof(ph.chksum), "%06o", sum);
+		tar_write(&ph, sizeof(ph));
+		tar_write(pax, pax_len);
+		tar_pad();
+		free(pax);
 	}
 
-	if (offset != 0 && offset != len)	/* partial chunk */
-		prt_err(1, 0, "Broken image file");
+	snprintf(th.mode, sizeof(th.mode), "%07o", oh->yst_mode & 07777);
+	snprintf(th.uid, sizeof(th.uid), "%07o", oh->yst_uid & 07777777);
+	snprintf(th.gid, sizeof(th.gid), "%07o", oh->yst_gid & 07777777);
+	snprintf(th.size, sizeof(th.size), "%011lo", (unsigned long)size);
+	snprintf(th.mtime, sizeof(th.mtime), "%011lo", (unsigned long)oh->yst_mtime);
+	th.typeflag = type;
+	memcpy(th.magic, "ustar", 6);
+	memcpy(th.version, "00", 2);
+	if (type == '3' || type == '4') {
+		snprintf(th.devmajor, sizeof(th.devmajor), "%07o",
+		         (unsigned)major(oh->yst_rdev));
+		snprintf(th.devminor, sizeof(th.devminor), "%07o",
+		         (unsigned)minor(oh->yst_rdev));
+	}
+	memset(th.chksum, ' ', sizeof(th.chksum));
+	for (i = 0, sum = 0; i < sizeof(th); i++)
+		sum += ((unsigned char *)&th)[i];
+	snprintf(th.chksum, sizeof(th.chksum), "%06o", sum);
+	tar_write(&th, sizeof(th));
+}
 
-	return offset != 0;
+/* add an object to the archive, for regular files including the data */
+static void tar_object(object *obj, yaffs_ObjectHeader *oh, int indexed) {
+	object *eq_obj;
+	char *path;
+
+	path = malloc(strlen(yaffs_path(obj)) + 3);
+	if (path == NULL)
+		prt_err(1, 0, "Malloc path name failed.");
+	strcpy(path, yaffs_path(obj));
+
+	switch(oh->type) {
+		case YAFFS_OBJECT_TYPE_FILE:
+			tar_entry(path, NULL, '0', oh, oh->fileSize > 0 ? oh->fileSize : 0);
+			write_data(tar_fd, obj, oh, indexed);
+			tar_pad();
+			break;
+		case YAFFS_OBJECT_TYPE_SYMLINK:
+			tar_entry(path, oh->alias, '2', oh, 0);
+			break;
+		case YAFFS_OBJECT_TYPE_DIRECTORY:
+			strcat(path, "/");
+			tar_entry(path, NULL, '5', oh, 0);
+			obj->flags |= OBJ_CREATED;
+			break;
+		case YAFFS_OBJECT_TYPE_HARDLINK:
+			eq_obj = yaffs_get_object(ctx->img, oh->equivalentObjectId);
+			if (eq_obj == NULL)
+				prt_err(1, 0, "Invalid equivalentObjectId %u in object %u (%s)",
+				        oh->equivalentObjectId, obj->id, oh->name);
+			if (!obj_selected(eq_obj)) {
+				prt_err(0, 0, "Warning: Can't archive hardlink %s, %s is not archived",
+				        path, yaffs_path(eq_obj));
+				break;
+			}
+			tar_entry(path, yaffs_path(eq_obj), '1', oh, 0);
+			break;
+		case YAFFS_OBJECT_TYPE_SPECIAL:
+			switch (oh->yst_mode & S_IFMT) {
+				case S_IFCHR:	tar_entry(path, NULL, '3', oh, 0); break;
+				case S_IFBLK:	tar_entry(path, NULL, '4', oh, 0); break;
+				case S_IFIFO:	tar_entry(path, NULL, '6', oh, 0); break;
+				default:
+					prt_err(0, 0, "Warning: Can't archive %s", path);
+					break;
+			}
+			break;
+		case YAFFS_OBJECT_TYPE_UNKNOWN:
+			break;
+	}
+	free(path);
+}
+
+/* end of archive: two zero blocks, padded to a full record */
+static void tar_finish(void) {
+	static const char zero[TAR_BLOCK];
+
+	tar_write(zero, TAR_BLOCK);
+	tar_write(zero, TAR_BLOCK);
+	while (tar_pos % TAR_RECORD != 0)
+		tar_write(zero, TAR_BLOCK);
+}
+
+/*
+ * next_object - read the next object of the image, returns NULL at the
+ * end. New objects get selected and, if print is set, listed.
+ */
+static object *next_object(yaffs_ObjectHeader **ohp, int print) {
+	object *obj;
+	int ret;
+
+	if ((ret = yaffs_next_object(ctx->img, &obj, ohp)) < 0)
+		img_fail();
+	if (ret == 0)
+		return NULL;
+	if (obj->parent != NULL)
+		select_object(obj);
+
+	/* listing */
+	if (!obj_selected(obj))
+		;
+	else if (print && opt_verbose)
+		prt_node(yaffs_path(obj), *ohp);
+	else if (print && opt_list)
+		printf("%s\n", yaffs_path(obj));
+
+	return obj;
+}
+
+/*
+ * create_parents - create the parent directories of a selected object,
+ * which weren't selected themselves. Their header is read again from
+ * the image, or for a stream rebuilt from the saved attributes.
+ */
+static void create_parents(object *obj, int indexed) {
+	yaffs_ObjectHeader oh_buf, *oh;
+	object *dir;
+
+	dir = obj->parent;
+	if (dir == NULL || (dir->flags & OBJ_CREATED))
+		return;
+	create_parents(dir, indexed);
+
+	if (ctx->img->seekable && dir->hdr_pos >= 0)
+		oh = read_header(dir, &oh_buf);
+	else {
+		memset(&oh_buf, 0, sizeof(oh_buf));
+		oh_buf.type = YAFFS_OBJECT_TYPE_DIRECTORY;
+		oh_buf.yst_mode  = dir->mode;
+		oh_buf.yst_uid   = dir->uid;
+		oh_buf.yst_gid   = dir->gid;
+		oh_buf.yst_atime = dir->atime;
+		oh_buf.yst_mtime = dir->mtime;
+		oh = &oh_buf;
+	}
+	if (tar_fd >= 0)
+		tar_object(dir, oh, indexed);
+	else
+		extract_object(dir, oh, indexed);
+}
+
+/* list, archive or extract an object, read in image order */
+void process_object(object *obj, yaffs_ObjectHeader *oh) {
+	if (opt_list || !obj_selected(obj))
+		return;		/* the data is skipped by next_object() */
+
+	create_parents(obj, 0);
+	if (tar_fd >= 0)
+		tar_object(obj, oh, 0);
+	else
+		extract_object(obj, oh, 0);
+}
+
+/*
+ * Single file output (option -x): the data of one regular file is
+ * written to standard output. Without an index the image is only read
+ * up to the end of that file, the data of other files is skipped.
+ */
+static int cat_match(object *obj) {
+	const char *leaf;
+
+	leaf = strrchr(cat_path, '/');
+	leaf = leaf != NULL ? leaf + 1 : cat_path;
+	return strcmp(obj->name, leaf) == 0 && strcmp(yaffs_path(obj), cat_path) == 0;
+}
+
+static void cat_object(object *obj, yaffs_ObjectHeader *oh, int indexed) {
+	yaffs_ObjectHeader oh_buf;
+	object *eq_obj;
+
+	if (oh->type == YAFFS_OBJECT_TYPE_HARDLINK) {
+		eq_obj = yaffs_get_object(ctx->img, oh->equivalentObjectId);
+		if (eq_obj == NULL)
+			prt_err(1, 0, "Invalid equivalentObjectId %u in object %u (%s)",
+			        oh->equivalentObjectId, obj->id, oh->name);
+		if (!ctx->img->seekable)
+			prt_err(1, 0, "Can't read hardlinked file %s from a stream", cat_path);
+		obj = eq_obj;
+		oh = read_header(obj, &oh_buf);
+		indexed = 1;
+	}
+	if (oh->type != YAFFS_OBJECT_TYPE_FILE)
+		prt_err(1, 0, "%s is not a regular file", cat_path);
+	write_data(STDOUT_FILENO, obj, oh, indexed);
+}
+
+/*
+ * Two-phase extraction for seekable images:
+ * index_image() builds the object table in a first pass, skipping
+ * over the data chunks (or load_index() reads it from an index file).
+ * Then extract_indexed() creates the directories
+ * (and other non-file objects), writes the regular files with a pool of
+ * worker threads, largest files first, and finally creates the hardlinks
+ * and sets the directory times.
+ */
+pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_index(object *obj) {
+	if (ctx->idx_count >= ctx->idx_alloc) {
+		ctx->idx_alloc = ctx->idx_alloc ? 2 * ctx->idx_alloc : 1024;
+		ctx->idx_list = realloc(ctx->idx_list, ctx->idx_alloc * sizeof(object *));
+		if (ctx->idx_list == NULL)
+			prt_err(1, 0, "Malloc object index failed.");
+	}
+	ctx->idx_list[ctx->idx_count++] = obj;
 }
 
-void detect_chunk_size(void) {
+static void index_image(void) {
 	yaffs_ObjectHeader *oh;
-	yaffs_PackedTags2  *pt, *pt2;
-	int      i;
-
-	memset(buffer, 0xff, sizeof(buffer));
-	buf_len = xread(img_file, buffer, sizeof(buffer));
-	if (buf_len < 0)
-		prt_err(1, errno, "Read image file");
-
-	oh = (yaffs_ObjectHeader *)buffer;
-	if (oh->parentObjectId != YAFFS_OBJECTID_ROOT ||
-	    (oh->type          != YAFFS_OBJECT_TYPE_FILE &&
-	     oh->type          != YAFFS_OBJECT_TYPE_DIRECTORY &&
-	     oh->type          != YAFFS_OBJECT_TYPE_SYMLINK &&
-	     oh->type          != YAFFS_OBJECT_TYPE_HARDLINK &&
-	     oh->type          != YAFFS_OBJECT_TYPE_SPECIAL))
-		prt_err(1, 0, "Not a yaffs2 image");
-
-	for (i = 0; i < max_layout; i++) {
- 		pt  = (yaffs_PackedTags2 *)
-		      (buffer + possible_layouts[i].chunk_size);
-		pt2 = (yaffs_PackedTags2 *)
-		      (buffer + 2 * possible_layouts[i].chunk_size +
-		       possible_layouts[i].spare_size);
-
-		if (pt->t.byteCount == 0xffff && pt->t.chunkId == 0 &&
-		    ((pt2->t.byteCount == 0xffff && pt2->t.chunkId == 0) ||
-		     (pt2->t.objectId == pt->t.objectId && pt2->t.chunkId == 1)))
+	object *obj;
+
+	while ((obj = next_object(&oh, 0)) != NULL)
+		add_index(obj);
+}
+
+static int cmp_file_size(const void *a, const void *b) {
+	const object *obj_a = *(const object **)a;
+	const object *obj_b = *(const object **)b;
+
+	if (obj_a->file_size != obj_b->file_size)
+		return obj_a->file_size < obj_b->file_size ? 1 : -1;
+	return obj_a->hdr_pos < obj_b->hdr_pos ? -1 : 1;
+}
+
+static void *file_worker(void *arg) {
+	yaffs_ObjectHeader oh_buf;
+	object *obj;
+
+	for (;;) {
+		pthread_mutex_lock(&file_lock);
+		obj = ctx->file_next < ctx->file_count ? ctx->file_list[ctx->file_next++] : NULL;
+		pthread_mutex_unlock(&file_lock);
+		if (obj == NULL)
 			break;
+		extract_object(obj, read_header(obj, &oh_buf), 1);
+	}
+	release_write_state();
+	return NULL;
+}
+
+void extract_indexed(int threads) {
+	yaffs_ObjectHeader oh_buf, *oh;
+	pthread_t *tid;
+	object *obj;
+	int i;
+
+	/* directories, symlinks and special files */
+	ctx->file_list = malloc((ctx->idx_count + 1) * sizeof(object *));
+	if (ctx->file_list == NULL)
+		prt_err(1, 0, "Malloc file list failed.");
+	ctx->file_count = 0;
+	for (i = 0; i < ctx->idx_count; i++) {
+		obj = ctx->idx_list[i];
+		if (!obj_selected(obj) || obj->type == YAFFS_OBJECT_TYPE_HARDLINK)
+			continue;
+		create_parents(obj, 1);
+		if (obj->type == YAFFS_OBJECT_TYPE_FILE)
+			ctx->file_list[ctx->file_count++] = obj;
+		else
+			extract_object(obj, read_header(obj, &oh_buf), 1);
+	}
+
+	/* regular files */
+	qsort(ctx->file_list, ctx->file_count, sizeof(object *), cmp_file_size);
+	ctx->file_next = 0;
+	if (threads > ctx->file_count)
+		threads = ctx->file_count;
+	if (threads <= 1)
+		file_worker(NULL);
+	else {
+		if ((tid = malloc(threads * sizeof(pthread_t))) == NULL)
+			prt_err(1, 0, "Malloc thread list failed.");
+		for (i = 0; i < threads; i++)
+			if ((errno = pthread_create(&tid[i], NULL, file_worker, NULL)) != 0)
+				prt_err(1, errno, "Can't create thread");
+		for (i = 0; i < threads; i++)
+			pthread_join(tid[i], NULL);
+		free(tid);
+	}
+	free(ctx->file_list);
+	ctx->file_list = NULL;
+
+	/* hardlinks */
+	for (i = 0; i < ctx->idx_count; i++) {
+		obj = ctx->idx_list[i];
+		if (obj->type == YAFFS_OBJECT_TYPE_HARDLINK && obj_selected(obj)) {
+			create_parents(obj, 1);
+			oh = read_header(obj, &oh_buf);
+			extract_object(obj, oh, 1);
+		}
+	}
+}
+
+/*
+ * process_indexed - list, archive or extract the indexed objects,
+ * the object headers are read directly from their image positions
+ */
+void process_indexed(int threads) {
+	yaffs_ObjectHeader oh_buf;
+	object *obj;
+	int i;
+
+	for (i = 0; i < ctx->idx_count; i++) {
+		obj = ctx->idx_list[i];
+		if (!obj_selected(obj))
+			;
+		else if (opt_verbose)
+			prt_node(yaffs_path(obj), read_header(obj, &oh_buf));
+		else if (opt_list)
+			printf("%s\n", yaffs_path(obj));
+	}
+
+	if (opt_list)
+		;
+	else if (tar_fd >= 0) {
+		for (i = 0; i < ctx->idx_count; i++) {
+			obj = ctx->idx_list[i];
+			if (!obj_selected(obj))
+				continue;
+			create_parents(obj, 1);
+			tar_object(obj, read_header(obj, &oh_buf), 1);
+		}
+	} else
+		extract_indexed(threads);
+
+	free(ctx->idx_list);
+	ctx->idx_list = NULL;
+	ctx->idx_count = ctx->idx_alloc = 0;
+}
+
+/* write the file of option -x, looked up in the index or the image */
+void cat_file(int indexed) {
+	yaffs_ObjectHeader oh_buf, *oh;
+	object *obj;
+	int i, found;
+
+	found = 0;
+	if (indexed) {
+		for (i = 0; i < ctx->idx_count && !found; i++) {
+			if (cat_match(ctx->idx_list[i])) {
+				cat_object(ctx->idx_list[i], read_header(ctx->idx_list[i], &oh_buf), 1);
+				found = 1;
+			}
+		}
+		free(ctx->idx_list);
+		ctx->idx_list = NULL;
+		ctx->idx_count = ctx->idx_alloc = 0;
+	} else {
+		while (!found && (obj = next_object(&oh, 0)) != NULL) {
+			if (cat_match(obj)) {
+				cat_object(obj, oh, 0);
+				found = 1;
+			}
+		}
 	}
+	if (!found)
+		prt_err(1, 0, "%s not found in image", cat_path);
+}
 
-	if (i >= max_layout)
-		prt_err(1, 0, "Can't determine chunk size");
+/*
+ * Index file (option -i): the object table of an image is saved in
+ * <image>.idx, so that later runs don't have to scan the image again.
+ * It contains the layout, one record per object (in image order) with
+ * parent, type, header position and file size, and the object names.
+ * The index is only used, if image size and mtime still match and the
+ * checksum is correct; otherwise it's rebuilt.
+ */
+#define INDEX_MAGIC		"UNYAFFSI"
+#define INDEX_VERSION		    1
+#define INDEX_BYTE_ORDER	0x01020304
+
+typedef struct {
+	char     magic[8];
+	__u32    byte_order;
+	__u32    version;
+	__u32    chunk_size;
+	__u32    spare_size;
+	__u32    obj_count;
+	__u32    names_size;
+	unsigned long long img_size;
+	long long img_mtime;
+	__u32    img_mtime_nsec;
+	__u32    checksum;		/* of everything following the header */
+} index_header;
+
+typedef struct {
+	__u32    id;
+	__u32    parent_id;
+	__u32    type;
+	__u32    name_off;
+	unsigned long long hdr_pos;
+	int      file_size;
+	__u32    atime;
+	__u32    mtime;
+	__u32    reserved;
+} index_record;
+
+/* FNV-1a hash */
+static __u32 index_checksum(const unsigned char *buf, size_t len) {
+	__u32 hash;
+
+	hash = 2166136261U;
+	while (len-- > 0)
+		hash = (hash ^ *buf++) * 16777619U;
+	return hash;
+}
+
+static void index_stat(index_header *ih) {
+	struct stat st;
+
+	memset(ih, 0, sizeof(*ih));
+	if (fstat(ctx->img->fd, &st) < 0)
+		return;
+	memcpy(ih->magic, INDEX_MAGIC, sizeof(ih->magic));
+	ih->byte_order = INDEX_BYTE_ORDER;
+	ih->version    = INDEX_VERSION;
+	ih->img_size   = st.st_size;
+	ih->img_mtime  = st.st_mtim.tv_sec;
+	ih->img_mtime_nsec = st.st_mtim.tv_nsec;
+}
 
-	chunk_size = possible_layouts[i].chunk_size;
-	spare_size = possible_layouts[i].spare_size;
+/*
+ * load_index - build the object table from the index file,
+ * returns 0 if there is no valid index
+ */
+int load_index(const struct yaffs_layout *layout) {
+	index_header cur, *ih;
+	index_record *rec;
+	object *obj, *parent;
+	unsigned char *map;
+	const char *names, *name;
+	struct stat st;
+	size_t len;
+	__u32 i;
+	int fd, ok;
+
+	if ((fd = open(ctx->index_name, O_RDONLY)) < 0)
+		return 0;
+	ok = 0;
+	map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= sizeof(index_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	ih = (index_header *)map;
+	index_stat(&cur);
+	len = st.st_size - sizeof(index_header);
+	if (memcmp(ih->magic, cur.magic, sizeof(ih->magic)) != 0 ||
+	    ih->byte_order != cur.byte_order || ih->version != cur.version ||
+	    ih->img_size != cur.img_size || ih->img_mtime != cur.img_mtime ||
+	    ih->img_mtime_nsec != cur.img_mtime_nsec ||
+	    (layout->chunk_size != 0 && ih->chunk_size != layout->chunk_size) ||
+	    (layout->spare_size != 0 && ih->spare_size != layout->spare_size) ||
+	    len != (size_t)ih->obj_count * sizeof(index_record) + ih->names_size ||
+	    ih->checksum != index_checksum(map + sizeof(index_header), len) ||
+	    yaffs_set_layout(ctx->img, ih->chunk_size, ih->spare_size,
+	                     layout->block_chunks) < 0)
+		goto out;
+
+	rec = (index_record *)(map + sizeof(index_header));
+	names = (const char *)(rec + ih->obj_count);
+	for (i = 0; i < ih->obj_count; i++, rec++) {
+		if (rec->id == YAFFS_OBJECTID_ROOT) {
+			obj = yaffs_get_object(ctx->img, YAFFS_OBJECTID_ROOT);
+			if (ctx->img->last_dir_id == 0)
+				ctx->img->last_dir_id = YAFFS_OBJECTID_ROOT;
+		} else {
+			parent = yaffs_get_object(ctx->img, rec->parent_id);
+			if (parent == NULL || yaffs_get_object(ctx->img, rec->id) != NULL ||
+			    rec->name_off >= ih->names_size)
+				goto out;
+			/* the same names as in object headers are accepted */
+			name = names + rec->name_off;
+			if (memchr(name, '\0', ih->names_size - rec->name_off) == NULL ||
+			    name[0] == '\0' || strchr(name, '/') != NULL ||
+			    strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+				goto out;
+			obj = yaffs_new_object(ctx->img, rec->id, parent, rec->type, name);
+			if (obj == NULL) {
+				munmap(map, st.st_size);	/* may not return */
+				prt_err(1, 0, "Malloc object failed.");
+			}
+			select_object(obj);
+		}
+		obj->hdr_pos = rec->hdr_pos;
+		obj->file_size = rec->file_size;
+		obj->atime = rec->atime;
+		obj->mtime = rec->mtime;
+		add_index(obj);
+	}
+	ok = 1;
 	if (opt_verbose)
+		fprintf(stderr, "Using index %s, chunk size = %d, spare size = %d.\n",
+		        ctx->index_name, ctx->img->chunk_size, ctx->img->spare_size);
+out:
+	munmap(map, st.st_size);
+	if (!ok && ctx->idx_count > 0)
+		prt_err(1, 0, "Broken index file %s", ctx->index_name);
+	return ok;
+}
+
+/* save the object table of the scanned image, errors are only warnings */
+void save_index(void) {
+	index_header ih;
+	index_record *rec;
+	unsigned char *buf;
+	char *tmp_name;
+	size_t len, names_size;
+	object *obj;
+	int i, fd;
+
+	names_size = 0;
+	for (i = 0; i < ctx->idx_count; i++)
+		names_size += strlen(ctx->idx_list[i]->name) + 1;
+	len = ctx->idx_count * sizeof(index_record) + names_size;
+	buf = malloc(len + 1);
+	tmp_name = malloc(strlen(ctx->index_name) + 5);
+	if (buf == NULL || tmp_name == NULL)
+		prt_err(1, 0, "Malloc index failed.");
+
+	rec = (index_record *)buf;
+	names_size = ctx->idx_count * sizeof(index_record);
+	for (i = 0; i < ctx->idx_count; i++, rec++) {
+		obj = ctx->idx_list[i];
+		memset(rec, 0, sizeof(*rec));
+		rec->id = obj->id;
+		rec->parent_id = obj->parent != NULL ? obj->parent->id : 0;
+		rec->type = obj->type;
+		rec->name_off = names_size - ctx->idx_count * sizeof(index_record);
+		rec->hdr_pos = obj->hdr_pos;
+		rec->file_size = obj->file_size;
+		rec->atime = obj->atime;
+		rec->mtime = obj->mtime;
+		strcpy((char *)buf + names_size, obj->name);
+		names_size += strlen(obj->name) + 1;
+	}
+
+	index_stat(&ih);
+	ih.chunk_size = ctx->img->chunk_size;
+	ih.spare_size = ctx->img->spare_size;
+	ih.obj_count  = ctx->idx_count;
+	ih.names_size = len - ctx->idx_count * sizeof(index_record);
+	ih.checksum   = index_checksum(buf, len);
+
+	sprintf(tmp_name, "%s.tmp", ctx->index_name);
+	fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 ||
+	    xwrite(fd, &ih, sizeof(ih)) != sizeof(ih) ||
+	    xwrite(fd, buf, len) != len ||
+	    close(fd) < 0 || rename(tmp_name, ctx->index_name) < 0) {
+		prt_err(0, errno, "Warning: Can't write index %s", ctx->index_name);
+		if (fd >= 0)
+			unlink(tmp_name);
+	}
+	free(tmp_name);
+	free(buf);
+}
+
+/* detect the sizes of the layout, that aren't given */
+static void detect_chunk_size(const struct yaffs_layout *layout) {
+	if (yaffs_probe_layout(ctx->img, layout->chunk_size, layout->spare_size) < 0 ||
+	    (layout->block_chunks != 0 &&
+	     yaffs_set_layout(ctx->img, ctx->img->chunk_size, ctx->img->spare_size,
+	                      layout->block_chunks) < 0))
+		img_fail();
+	if (opt_verbose && ctx->img->block_chunks != 0)
+		fprintf(stderr, "Header check OK, chunk size = %d, spare size = %d, "
+		        "block = %d chunks.\n", ctx->img->chunk_size,
+		        ctx->img->spare_size, ctx->img->block_chunks);
+	else if (opt_verbose)
 		fprintf(stderr,
 		        "Header check OK, chunk size = %d, spare size = %d.\n",
-		        chunk_size, spare_size);
+		        ctx->img->chunk_size, ctx->img->spare_size);
+}
+
+/* set the layout, detect it if the sizes aren't all given */
+static void set_layout(const struct yaffs_layout *layout) {
+	if (layout->chunk_size == 0 || layout->spare_size == 0)
+		detect_chunk_size(layout);
+	else if (yaffs_set_layout(ctx->img, layout->chunk_size, layout->spare_size,
+	                          layout->block_chunks) < 0)
+		img_fail();
+}
+
+enum { OPT_CHUNK_SIZE = 256, OPT_SPARE_SIZE, OPT_BLOCK_CHUNKS,
+       OPT_INCLUDE, OPT_EXCLUDE, OPT_BATCH, OPT_STATS, OPT_NO_PREALLOC };
+
+void usage(void);
+
+/*
+ * layout_option - handle the options -l, --chunk-size, --spare-size
+ * and --block-chunks, returns 0 for other options
+ */
+static int layout_option(int ch, const char *arg, struct yaffs_layout *layout) {
+	char *end;
+	long val;
+
+	if (ch == 'l') {
+		if (arg[0] < '0' || arg[0] > '0' + yaffs_layout_count ||
+		    arg[1] != '\0') usage();
+		if (arg[0] == '0')
+			layout->chunk_size = layout->spare_size = 0;
+		else {
+			layout->chunk_size = yaffs_layouts[arg[0] - '1'].chunk_size;
+			layout->spare_size = yaffs_layouts[arg[0] - '1'].spare_size;
+		}
+		return 1;
+	}
+	if (ch != OPT_CHUNK_SIZE && ch != OPT_SPARE_SIZE && ch != OPT_BLOCK_CHUNKS)
+		return 0;
+
+	val = strtol(arg, &end, 10);
+	if (*end != '\0') usage();
+	if (ch == OPT_CHUNK_SIZE) {
+		if (val < (long)sizeof(yaffs_ObjectHeader) ||
+		    val > YAFFS_MAX_CHUNK_SIZE) usage();
+		layout->chunk_size = val;
+	} else if (ch == OPT_SPARE_SIZE) {
+		if (val < (long)sizeof(yaffs_PackedTags2TagsPart) ||
+		    val > YAFFS_MAX_SPARE_SIZE) usage();
+		layout->spare_size = val;
+	} else {
+		if (val < 1 || val > 65536) usage();
+		layout->block_chunks = val;
+	}
+	return 1;
+}
+
+static const char *sys_names[SYS_COUNT] = {
+	"open", "close", "mkdir", "symlink", "link", "mknod",
+	"write", "pread", "chown", "chmod", "utime",
+	"fallocate", "truncate", "io_uring_enter"
+};
+
+static const char *phase_names[PH_COUNT] = {
+	"open", "scan", "extract", "finish"
+};
+
+static const char *type_names[] = {
+	"unknown", "file", "symlink", "directory", "hardlink", "special"
+};
+
+static double wall_time(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* CPU time of the process, in batch mode of the current thread */
+static double cpu_time(void) {
+	struct timespec ts;
+
+	if (clock_gettime(ctx->fail != NULL ? CLOCK_THREAD_CPUTIME_ID :
+	                                      CLOCK_PROCESS_CPUTIME_ID, &ts) < 0)
+		return 0;
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* end the current phase and start the next one, PH_COUNT for none */
+static void stats_phase(int phase) {
+	struct t_stats *st = &ctx->stats;
+	double wall, cpu;
+
+	wall = wall_time();
+	cpu = cpu_time();
+	if (st->phase >= 0) {
+		st->wall[st->phase] += wall - st->phase_wall;
+		st->cpu[st->phase] += cpu - st->phase_cpu;
+	}
+	st->phase = phase < PH_COUNT ? phase : -1;
+	st->phase_wall = wall;
+	st->phase_cpu = cpu;
+}
+
+static void json_string(FILE *fp, const char *str) {
+	const unsigned char *cp;
+
+	putc('"', fp);
+	for (cp = (const unsigned char *)str; *cp != '\0'; cp++) {
+		if (*cp == '"' || *cp == '\\')
+			fprintf(fp, "\\%c", *cp);
+		else if (*cp < 0x20)
+			fprintf(fp, "\\u%04x", *cp);
+		else
+			putc(*cp, fp);
+	}
+	putc('"', fp);
+}
+
+/* print the statistics of the current image as one line of JSON */
+static void stats_print(void) {
+	struct t_stats *st = &ctx->stats;
+	struct yaffs_stats *ist = &ctx->img->stats;
+	unsigned long types[YAFFS_OBJECT_TYPE_SPECIAL + 1];
+	unsigned long long img_bytes;
+	double wall, cpu;
+	object *obj;
+	unsigned i;
+
+	memset(types, 0, sizeof(types));
+	for (i = 0; i < ctx->img->obj_table_size; i++)
+		if ((obj = ctx->img->obj_table[i]) != NULL)
+			types[obj->type <= YAFFS_OBJECT_TYPE_SPECIAL ? obj->type : 0]++;
+	wall = cpu = 0;
+	for (i = 0; i < PH_COUNT; i++) {
+		wall += st->wall[i];
+		cpu += st->cpu[i];
+	}
+	img_bytes = ctx->img->seekable ? ctx->img->size : ist->bytes_read;
+
+	flockfile(stderr);
+	fprintf(stderr, "{\"image\":");
+	json_string(stderr, ctx->name);
+	fprintf(stderr, ",\"chunk_size\":%d,\"spare_size\":%d,\"phases\":{",
+	        ctx->img->chunk_size, ctx->img->spare_size);
+	for (i = 0; i < PH_COUNT; i++)
+		fprintf(stderr, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}",
+		        i > 0 ? "," : "", phase_names[i], st->wall[i], st->cpu[i]);
+	fprintf(stderr, "},\"wall\":%.6f,\"cpu\":%.6f", wall, cpu);
+	fprintf(stderr, ",\"chunks\":{\"read\":%lu,\"skipped\":%lu,\"erased\":%lu"
+	        ",\"obsolete\":%lu}", ist->chunks_read, ist->chunks_skipped,
+	        ist->chunks_erased, ist->chunks_obsolete);
+	fprintf(stderr, ",\"warnings\":%d,\"objects\":{", ctx->img->warn_count);
+	for (i = 0; i <= YAFFS_OBJECT_TYPE_SPECIAL; i++)
+		fprintf(stderr, "%s\"%s\":%lu", i > 0 ? "," : "",
+		        type_names[i], types[i]);
+	fprintf(stderr, "},\"image_bytes\":%llu,\"bytes_read\":%llu"
+	        ",\"bytes_written\":%llu", img_bytes, ist->bytes_read,
+	        st->bytes_written);
+	fprintf(stderr, ",\"syscalls\":{\"read\":%lu,\"seek\":%lu",
+	        ist->read_calls, ist->seek_calls);
+	for (i = 0; i < SYS_COUNT; i++)
+		fprintf(stderr, ",\"%s\":%lu", sys_names[i], st->sys[i]);
+	fprintf(stderr, "},\"mb_per_s\":%.1f,\"write_mb_per_s\":%.1f}\n",
+	        wall > 0 ? img_bytes / 1e6 / wall : 0,
+	        wall > 0 ? st->bytes_written / 1e6 / wall : 0);
+	funlockfile(stderr);
+}
+
+/*
+ * open_image - open the image of the current context and get its layout,
+ * returns 1 if the object table is indexed (from the index file or,
+ * with two_pass, by a first scan of the image)
+ */
+static int open_image(const char *name, const struct yaffs_layout *layout,
+                      int two_pass) {
+	int ret, indexed;
+
+	ctx->name = name;
+	stats_phase(PH_OPEN);
+	if (strcmp(name, "-") == 0) {	/* image file from stdin ? */
+		ctx->img_file = 0;
+	} else {
+		ctx->img_file = open(name, O_RDONLY);
+		if (ctx->img_file < 0)
+			prt_err(1, errno, "Open image file failed");
+	}
+	if ((ret = yaffs_open(&ctx->img, ctx->img_file, buf_size)) < 0)
+		prt_err(1, ret == -YAFFS_ERR_NOMEM ? 0 : errno, "%s",
+		        yaffs_strerror(ret));
+	ctx->img->warn = img_warn;
+	ctx->img->refill_hook = uring_drain;		/* writes still use the buffer */
+	yaffs_get_object(ctx->img, YAFFS_OBJECTID_ROOT)->flags = OBJ_CREATED;
+
+	indexed = 0;
+	if (opt_index && ctx->img->seekable && strcmp(name, "-") != 0) {
+		if ((ctx->index_name = malloc(strlen(name) + 5)) == NULL)
+			prt_err(1, 0, "Malloc index name failed.");
+		sprintf(ctx->index_name, "%s.idx", name);
+		indexed = load_index(layout);
+	}
+
+	if (!indexed)
+		set_layout(layout);
+
+	/* full or chunk map scan, the objects are always indexed */
+	if (opt_full || opt_map) {
+		stats_phase(PH_SCAN);
+		if ((opt_full ? yaffs_full_scan(ctx->img) : yaffs_map_scan(ctx->img)) < 0)
+			img_fail();
+		index_image();
+		return 1;
+	}
+
+	/* first pass of the two-phase processing */
+	if (!indexed && ctx->img->seekable &&
+	    (ctx->index_name != NULL || two_pass)) {
+		stats_phase(PH_SCAN);
+		index_image();
+		if (ctx->index_name != NULL)
+			save_index();
+		indexed = 1;
+	}
+	return indexed;
+}
+
+/* release everything of the current context, also after a failure */
+static void close_image(void) {
+	release_write_state();
+	flush_dir_cache();
+	if (ctx->root_fd >= 0)
+		close(ctx->root_fd);
+	ctx->root_fd = -1;
+	if (ctx->img != NULL)
+		yaffs_close(ctx->img);
+	ctx->img = NULL;
+	if (ctx->img_file >= 0)
+		close(ctx->img_file);
+	ctx->img_file = -1;
+	free(ctx->index_name);
+	free(ctx->idx_list);
+	free(ctx->file_list);
+	ctx->index_name = NULL;
+	ctx->idx_list = ctx->file_list = NULL;
+	ctx->idx_count = ctx->idx_alloc = ctx->file_count = 0;
+}
+
+/*
+ * Batch mode (option --batch): the images named in a list file are
+ * extracted into subdirectories of the base dir, named after the image
+ * file without its extension. A pool of -j threads (default: one per
+ * CPU) works on the images in parallel, each image is extracted by
+ * one thread in a single pass, so the number of open images and read
+ * buffers is bounded by the pool size. A failing image doesn't stop
+ * the others, the exit code reports it.
+ */
+struct t_context *batch_list = NULL;
+int batch_count = 0;
+int batch_next = 0;
+struct yaffs_layout batch_layout;
+int batch_failed = 0;
+pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* read the image names, one per line, - for standard input */
+static void read_batch_list(const char *list_name) {
+	FILE *fp;
+	char *line, *nl;
+	size_t line_size;
+	int alloc;
+
+	if (strcmp(list_name, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(list_name, "r")) == NULL)
+		prt_err(1, errno, "Can't open batch list %s", list_name);
+
+	line = NULL;
+	line_size = 0;
+	alloc = 0;
+	while (getline(&line, &line_size, fp) >= 0) {
+		if ((nl = strchr(line, '\n')) != NULL)
+			*nl = '\0';
+		if (line[0] == '\0')
+			continue;
+		if (batch_count >= alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			batch_list = realloc(batch_list, alloc * sizeof(struct t_context));
+			if (batch_list == NULL)
+				prt_err(1, 0, "Malloc batch list failed.");
+		}
+		memset(&batch_list[batch_count], 0, sizeof(struct t_context));
+		if ((batch_list[batch_count].name = strdup(line)) == NULL)
+			prt_err(1, 0, "Malloc batch list failed.");
+		batch_count++;
+	}
+	if (ferror(fp))
+		prt_err(1, errno, "Can't read batch list %s", list_name);
+	if (fp != stdin)
+		fclose(fp);
+	free(line);
+}
+
+/* output directory of an image: <base dir>/<file name without extension> */
+static char *batch_dir(const char *base, const char *name) {
+	const char *leaf, *ext;
+	char *dir;
+	size_t len;
+
+	leaf = strrchr(name, '/');
+	leaf = leaf != NULL ? leaf + 1 : name;
+	ext = strrchr(leaf, '.');
+	len = (ext != NULL && ext != leaf) ? ext - leaf : strlen(leaf);
+	if ((dir = malloc(strlen(base) + len + 2)) == NULL)
+		prt_err(1, 0, "Malloc directory name failed.");
+	sprintf(dir, "%s/%.*s", base, (int)len, leaf);
+	return dir;
+}
+
+/* extract the image of the current context */
+static void batch_image(void) {
+	yaffs_ObjectHeader *oh;
+	object *obj;
+	int indexed;
+
+	indexed = open_image(ctx->name, &batch_layout, 0);
+	if (mkdirpath(ctx->out_dir) < 0)
+		prt_err(1, errno, "Can't mkdir %s", ctx->out_dir);
+	if ((ctx->root_fd = open(ctx->out_dir, O_RDONLY | O_DIRECTORY)) < 0)
+		prt_err(1, errno, "Can't open directory %s", ctx->out_dir);
+
+	stats_phase(PH_EXTRACT);
+	if (indexed)
+		process_indexed(1);
+	else
+		while ((obj = next_object(&oh, 0)) != NULL)
+			process_object(obj, oh);
+	stats_phase(PH_FINISH);
+	set_dirs_utime();
+	stats_phase(PH_COUNT);
+}
+
+static void *batch_worker(void *arg) {
+	struct timespec start, end;
+	jmp_buf fail;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&batch_lock);
+		i = batch_next < batch_count ? batch_next++ : -1;
+		pthread_mutex_unlock(&batch_lock);
+		if (i < 0)
+			break;
+
+		ctx = &batch_list[i];
+		ctx->img_file = ctx->root_fd = -1;
+		init_dir_cache();		/* close_image() flushes it */
+		pthread_mutex_init(&ctx->dir_cache_lock, NULL);
+		ctx->fail = &fail;
+		ctx->stats.phase = -1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (setjmp(fail) == 0) {
+			batch_image();
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			printf("%s: %lu objects, %llu bytes, %.3f s\n",
+			       ctx->name, ctx->objects, ctx->bytes,
+			       (end.tv_sec - start.tv_sec) +
+			       (end.tv_nsec - start.tv_nsec) / 1e9);
+			if (opt_stats)
+				stats_print();
+		} else {
+			pthread_mutex_lock(&batch_lock);
+			batch_failed++;
+			pthread_mutex_unlock(&batch_lock);
+		}
+		close_image();
+		pthread_mutex_destroy(&ctx->dir_cache_lock);
+		ctx->fail = NULL;
+		ctx = &main_ctx;
+	}
+	return NULL;
+}
+
+/* extract all images of the batch list, returns the exit code */
+static int batch_extract(const char *base, int threads) {
+	pthread_t *tid;
+	int i, j;
+
+	for (i = 0; i < batch_count; i++) {
+		batch_list[i].out_dir = batch_dir(base, batch_list[i].name);
+		for (j = 0; j < i; j++)
+			if (strcmp(batch_list[i].out_dir, batch_list[j].out_dir) == 0)
+				prt_err(1, 0, "%s and %s have the same output directory %s",
+				        batch_list[j].name, batch_list[i].name,
+				        batch_list[i].out_dir);
+	}
+
+	if (threads > batch_count)
+		threads = batch_count;
+	if (threads <= 1)
+		batch_worker(NULL);
+	else {
+		if ((tid = malloc(threads * sizeof(pthread_t))) == NULL)
+			prt_err(1, 0, "Malloc thread list failed.");
+		for (i = 0; i < threads; i++)
+			if ((errno = pthread_create(&tid[i], NULL, batch_worker, NULL)) != 0)
+				prt_err(1, errno, "Can't create thread");
+		for (i = 0; i < threads; i++)
+			pthread_join(tid[i], NULL);
+		free(tid);
+	}
+
+	for (i = 0; i < batch_count; i++) {
+		free((char *)batch_list[i].name);
+		free(batch_list[i].out_dir);
+	}
+	free(batch_list);
+	return batch_failed > 0 ? 1 : 0;
 }
 
 void usage(void) {
 	fprintf(stderr, "\
 unyaffs - extract files from a YAFFS2 file system image.\n\
 \n\
-Usage: unyaffs [-l <layout>] [-t] [-v] [-V] <image_file_name> [<base dir>]\n\
+Usage: unyaffs [-b <size>] [-f | -i | -m] [-l <layout>] [-j <threads>] [-s]\n\
+               [-t] [-u] [-v] [-V] [--include <pattern>] [--exclude <pattern>]\n\
+               <image_file_name> [<base dir>]\n\
+       unyaffs [-b <size>] [-f | -i | -m] [-l <layout>] [-v]\n\
+               [--include <pattern>] [--exclude <pattern>] -o <archive>\n\
+               <image_file_name>\n\
+       unyaffs [-b <size>] [-f | -i | -m] [-l <layout>] [-v] -x <path>\n\
+               <image_file_name>\n\
+       unyaffs [-b <size>] [-f | -i | -m] [-l <layout>] [-j <threads>] [-s]\n\
+               [--include <pattern>] [--exclude <pattern>]\n\
+               --batch <list_file> [<base dir>]\n\
+    -b <size>        read buffer size in KB (default 4096)\n\
+    -f               full scan, for images (nanddumps) of used partitions\n\
+    -m               map the data chunks of each file by chunkId, for images\n\
+                     with interleaved or out of order chunks\n\
+    -i               use (or create) index file <image_file_name>.idx\n\
     -l <layout>      set flash memory layout\n\
         layout=0: detect chunk and spare size (default)\n\
         layout=1:  2K chunk,  64 byte spare size\n\
         layout=2:  4K chunk, 128 byte spare size\n\
         layout=3:  8K chunk, 256 byte spare size\n\
         layout=4: 16K chunk, 512 byte spare size\n\
+    --chunk-size <bytes>   set chunk (page) size, 512 to 16384\n\
+    --spare-size <bytes>   set spare (oob) size, 16 to 1280\n\
+    --block-chunks <count> set chunks per erase block\n\
+    -j <threads>     write files with <threads> parallel threads,\n\
+                     with --batch: extract <threads> images in parallel,\n\
+                     the files of each image with one thread\n\
+    -o <archive>     write a tar (pax) archive instead of extracting files,\n\
+                     - for standard output\n\
+    -s               create sparse files, skipping zero filled chunks\n\
     -t               list image contents\n\
+    -u               use io_uring for writing files, if available\n\
+                     (experimental, see \"make bench\")\n\
     -v               verbose output\n\
     -V               print version\n\
+    -x <path>        write the contents of file <path> to standard output\n\
+    --include <pattern>  only extract objects matching <pattern>\n\
+    --exclude <pattern>  don't extract objects matching <pattern>\n\
+    --batch <list_file>  extract the images listed in <list_file>\n\
+    --stats              print statistics (JSON) to stderr\n\
+    --no-prealloc        don't preallocate the space of files (fallocate)\n\
 ");
 	exit(1);
 }
 
+static struct option long_options[] = {
+	{ "include",      required_argument, NULL, OPT_INCLUDE },
+	{ "exclude",      required_argument, NULL, OPT_EXCLUDE },
+	{ "batch",        required_argument, NULL, OPT_BATCH },
+	{ "stats",        no_argument,       NULL, OPT_STATS },
+	{ "no-prealloc",  no_argument,       NULL, OPT_NO_PREALLOC },
+	{ "chunk-size",   required_argument, NULL, OPT_CHUNK_SIZE },
+	{ "spare-size",   required_argument, NULL, OPT_SPARE_SIZE },
+	{ "block-chunks", required_argument, NULL, OPT_BLOCK_CHUNKS },
+	{ NULL, 0, NULL, 0 }
+};
+
 int main(int argc, char **argv) {
-	int ch;
-	int layout = 0;
+	yaffs_ObjectHeader *oh;
+	object *obj;
+	char *end, *tar_name, *batch_name;
+	int indexed;
+	struct yaffs_layout layout = { 0, 0, 0 };
+	int ch, ret;
 
 	/* handle command line options */
 	opt_list = 0;
 	opt_verbose = 0;
-	while ((ch = getopt(argc, argv, "l:tvVh?")) > 0) {
+	opt_threads = 0;
+	opt_sparse = 0;
+	opt_uring = 0;
+	opt_index = 0;
+	opt_stats = 0;
+	opt_full = 0;
+	opt_map = 0;
+	opt_prealloc = 1;
+	tar_name = NULL;
+	batch_name = NULL;
+	while ((ch = getopt_long(argc, argv, "b:fil:j:mo:stuvVx:h?",
+	                         long_options, NULL)) > 0) {
+		if (layout_option(ch, optarg, &layout))
+			continue;
 		switch (ch) {
-			case 'l':
-				if (optarg[0] < '0' ||
-				    optarg[0] > '0' + max_layout ||
-				    optarg[1] != '\0') usage();
-				layout = optarg[0] - '0';
+			case OPT_INCLUDE:
+				add_pattern(&include_pat, &include_count, optarg);
+				break;
+			case OPT_EXCLUDE:
+				add_pattern(&exclude_pat, &exclude_count, optarg);
+				break;
+			case OPT_BATCH:
+				batch_name = optarg;
+				break;
+			case OPT_STATS:
+				opt_stats = 1;
+				break;
+			case OPT_NO_PREALLOC:
+				opt_prealloc = 0;
+				break;
+			case 'f':
+				opt_full = 1;
+				break;
+			case 'i':
+				opt_index = 1;
+				break;
+			case 'j':
+				opt_threads = atoi(optarg);
+				if (opt_threads < 1) usage();
+				break;
+			case 'm':
+				opt_map = 1;
+				break;
+			case 'b':
+				buf_size = strtoul(optarg, &end, 10) * 1024;
+				if (*end != '\0' || buf_size == 0) usage();
+				break;
+			case 'o':
+				tar_name = optarg;
+				break;
+			case 's':
+				opt_sparse = 1;
 				break;
 			case 't':
 				opt_list = 1;
 				break;
+			case 'u':
+				opt_uring = 1;
+				break;
 			case 'v':
 				opt_verbose = 1;
 				break;
+			case 'x':
+				cat_path = optarg;
+				while (cat_path[0] == '/' ||
+				       (cat_path[0] == '.' && cat_path[1] == '/'))
+					cat_path += cat_path[0] == '/' ? 1 : 2;
+				break;
 			case 'V':
-				printf("V%s\n", VERSION);
+				printf("V%s\n", UNYAFFS_VERSION);
 				exit(0);
 				break;
 			case 'h':
@@ -621,24 +2543,46 @@ int main(int argc, char **argv) {
 	}
 
 	/* extract rest of command line parameters */
+	if (opt_full + opt_index + opt_map > 1)
+		usage();
+	if (batch_name != NULL) {	/* many images, only extraction */
+		if ((argc - optind) > 1 || opt_list || opt_verbose ||
+		    opt_uring || tar_name != NULL || cat_path != NULL)
+			usage();
+		if (opt_threads == 0)
+			opt_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		read_batch_list(batch_name);
+		batch_layout = layout;
+		umask(0);
+		ret = batch_extract((argc - optind) == 1 ? argv[optind] : ".",
+		                    opt_threads);
+		free(include_pat);
+		free(exclude_pat);
+		return ret;
+	}
+	if (opt_threads == 0)
+		opt_threads = 1;
 	if ((argc - optind) < 1 || (argc - optind) > 2)
 		usage();
+	if (tar_name != NULL &&		/* archive instead of files */
+	    ((argc - optind) > 1 || opt_list ||
+	     (opt_verbose && strcmp(tar_name, "-") == 0)))
+		usage();
+	if (cat_path != NULL &&		/* single file to stdout */
+	    ((argc - optind) > 1 || opt_list || tar_name != NULL ||
+	     opt_threads > 1 || include_count > 0 || exclude_count > 0))
+		usage();
 
-	if (strcmp(argv[optind], "-") == 0) {	/* image file from stdin ? */
-		img_file = 0;
-	} else {
-		img_file = open(argv[optind], O_RDONLY);
-		if (img_file < 0)
-			prt_err(1, errno, "Open image file failed");
-	}
+	indexed = open_image(argv[optind], &layout,
+	                     opt_threads > 1 && !opt_list && tar_name == NULL);
 
-	if (layout == 0) {
-		detect_chunk_size();
-	} else {
-		chunk_size = possible_layouts[layout-1].chunk_size;
-		spare_size = possible_layouts[layout-1].spare_size;
+	if (tar_name != NULL) {
+		if (strcmp(tar_name, "-") == 0)
+			tar_fd = 1;
+		else if ((tar_fd = open(tar_name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+			prt_err(1, errno, "Can't create archive %s", tar_name);
+		out_stream = 1;
 	}
-	spare_data = data + chunk_size;
 
 	if ((argc - optind) == 2 && !opt_list) {
 		if (mkdirpath(argv[optind+1]) < 0)
@@ -649,11 +2593,35 @@ int main(int argc, char **argv) {
 
 	umask(0);
 
-	init_obj_list();
-	while (read_chunk()) {
-		process_chunk();
+	init_dir_cache();
+	stats_phase(PH_EXTRACT);
+	if (cat_path != NULL) {
+		out_stream = 1;
+		cat_file(indexed);
+	} else if (indexed) {
+		process_indexed(opt_threads);
+	} else {
+		if (opt_uring && !opt_list && tar_fd < 0 && !uring_init() &&
+		    opt_verbose)
+			fprintf(stderr, "io_uring not available, using syscalls.\n");
+		while ((obj = next_object(&oh, 1)) != NULL)
+			process_object(obj, oh);
 	}
-	set_dirs_utime();
-	close(img_file);
+	stats_phase(PH_FINISH);
+	if (tar_fd >= 0) {
+		tar_finish();
+		if (tar_fd != 1 && close(tar_fd) < 0)
+			prt_err(1, errno, "Can't write archive");
+	} else if (!opt_list && cat_path == NULL) {
+		set_files_utime();
+		set_dirs_utime();
+	}
+	uring_exit();
+	stats_phase(PH_COUNT);
+	if (opt_stats)
+		stats_print();
+	close_image();
+	free(include_pat);
+	free(exclude_pat);
 	return 0;
 }
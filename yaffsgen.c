@@ -0,0 +1,867 @@
+/*
+ * yaffsgen: generate synthetic YAFFS2 file system images
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * The images are written like mkyaffs2image does: the objects in
+ * depth-first order, each object header in its own chunk (byteCount
+ * 0xffff, unused bytes 0xff) followed by the data chunks of regular
+ * files, object ids counting from 257, sequence number 0x1000 and
+ * packed tags with ECC in the spare area.
+ * With option -i the data chunks of several files are interleaved,
+ * as if they were written at the same time.
+ * With option -u a part of the objects is written in an older version
+ * first, like on a used flash partition: moved and renamed (also over
+ * an object, that is shadowed then), files with some data chunks
+ * rewritten later or shrunk from a larger size, and files created and
+ * deleted again. The newer versions get the next sequence number and
+ * are written in front of the older ones, like an erase block allocated
+ * later at a lower address. Such images need unyaffs -f, the tree is
+ * the same as without -u.
+ * The tree is random, but reproducible: the same options generate the
+ * same image, so with option -c the tree extracted from an image can be
+ * checked against the generated objects.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include "unyaffs.h"
+
+#define FIRST_OBJECT_ID		  257	/* YAFFS_NOBJECT_BUCKETS + 1 */
+#define OBJECTID_ROOT		    1
+#define SEQUENCE_NUMBER		0x1000	/* YAFFS_LOWEST_SEQUENCE_NUMBER */
+#define OBJECTID_UNLINKED	    3
+#define OBJECTID_DELETED	    4
+#define BASE_TIME		1500000000
+
+static const struct {
+	int chunk_size;
+	int spare_size;
+} possible_layouts[] =
+	{ { 2048, 64 }, { 4096, 128 }, { 8192, 256 }, { 16384, 512 } };
+
+/* object mix in percent, the rest are regular files */
+enum { MIX_DIR, MIX_SYMLINK, MIX_HARDLINK, MIX_FIFO, MIX_DEVICE, MIX_ZERO,
+       MIX_COUNT };
+
+static const char *mix_names[MIX_COUNT] =
+	{ "dir", "symlink", "hardlink", "fifo", "device", "zero" };
+
+int mix[MIX_COUNT] = { 10, 3, 2, 1, 0, 5 };
+
+typedef struct t_object {
+	int      type;			/* yaffs_ObjectType */
+	int      parent;		/* index, -1 for the root */
+	int      depth;
+	int      child;			/* first child, -1 if none */
+	int      sibling;		/* next child of the parent */
+	int      last_child;
+	unsigned id;			/* object id in the image */
+	int      equiv;			/* hardlink target (index) */
+	int      file_size;
+	int      zero;			/* file contains only zero bytes */
+	unsigned mode;
+	unsigned rdev;
+	unsigned mtime;
+	char     name[16];
+} t_object;
+
+t_object *objs;
+int obj_count = 0;
+int *file_idx;				/* regular files written so far */
+int file_count = 0;
+
+int chunk_size = 2048;
+int spare_size = 64;
+int opt_count = 1000;
+int opt_depth = 5;
+int size_min = 0;
+int size_max = 1024*1024;
+int erased_pct = 0;
+int opt_interleave = 0;			/* files written at the same time */
+int opt_update = 0;			/* objects with an older version (-u) */
+unsigned long long seed = 1;
+
+FILE *out;				/* written to, one of these: */
+FILE *out_old;				/* image, or the older versions (-u) */
+FILE *out_new;				/* image */
+unsigned sequence = SEQUENCE_NUMBER;
+unsigned char *chunk_buf;
+unsigned long long chunks_total = 0;
+unsigned long long chunks_erased = 0;
+unsigned next_id;
+unsigned next_extra_id;			/* deleted and shadowed objects (-u) */
+int errors = 0;
+
+struct t_writing {			/* files with unwritten data (-i) */
+	t_object *obj;
+	long long pos;
+	int      chunk_id;
+} *writing;
+int writing_count = 0;
+int writing_next = 0;
+
+/* error reporting function, similar to GNU error() */
+static void prt_err(int status, int errnum, const char *format, ...) {
+	va_list varg;
+
+	va_start(varg, format);
+	fflush(stdout);
+	vfprintf(stderr, format, varg);
+	if (errnum != 0)
+		fprintf(stderr, ": %s", strerror(errnum));
+	fprintf(stderr, "\n");
+	va_end(varg);
+
+	if (status != 0)
+		exit(status);
+}
+
+/* xorshift64* random numbers, reproducible on all platforms */
+static unsigned long long rnd(void) {
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ULL;
+}
+
+static unsigned rnd_range(unsigned n) {
+	return n > 0 ? (rnd() >> 32) % n : 0;
+}
+
+/* file data, a function of object id and position */
+static unsigned long long data_word(unsigned id, unsigned long long idx) {
+	unsigned long long z;
+
+	z = ((unsigned long long)id << 40) + idx + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void fill_data(unsigned id, unsigned char *buf, long long offset,
+                      int len) {
+	unsigned long long w;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (i == 0 || (offset + i) % 8 == 0)
+			w = data_word(id, (offset + i) / 8);
+		buf[i] = w >> (8 * ((offset + i) % 8));
+	}
+}
+
+static void file_data(t_object *obj, unsigned char *buf, long long offset,
+                      int len) {
+	if (obj->zero)
+		memset(buf, 0, len);
+	else
+		fill_data(obj->id, buf, offset, len);
+}
+
+/*
+ * file sizes are distributed log-uniformly between size_min and
+ * size_max: a random number of bits, then a random value of that size
+ */
+static int file_size(void) {
+	unsigned long long range, s;
+	int bits;
+
+	range = (unsigned long long)size_max - size_min;
+	for (bits = 0; bits < 63 && (1ULL << bits) <= range; bits++);
+	bits = rnd_range(bits + 1);
+	s = bits > 0 ? rnd() & ((1ULL << bits) - 1) : 0;
+	return size_min + (s <= range ? s : range);
+}
+
+static void add_child(int parent, int idx) {
+	t_object *p = &objs[parent];
+
+	if (p->child < 0)
+		p->child = idx;
+	else
+		objs[p->last_child].sibling = idx;
+	p->last_child = idx;
+}
+
+/* random tree: object types by the mix, parents among the directories */
+static void build_tree(void) {
+	int *dirs;
+	int dir_count, i, r, m, parent;
+	t_object *obj;
+
+	if ((objs = calloc(opt_count + 1, sizeof(t_object))) == NULL ||
+	    (dirs = malloc((opt_count + 1) * sizeof(int))) == NULL ||
+	    (file_idx = malloc((opt_count + 1) * sizeof(int))) == NULL)
+		prt_err(1, 0, "Malloc object table failed.");
+
+	obj = &objs[0];				/* root */
+	obj->type = YAFFS_OBJECT_TYPE_DIRECTORY;
+	obj->parent = -1;
+	obj->child = obj->sibling = -1;
+	obj->id = OBJECTID_ROOT;
+	obj->mode = S_IFDIR | 0755;
+	obj->mtime = BASE_TIME;
+	dirs[0] = 0;
+	dir_count = 1;
+	obj_count = 1;
+
+	for (i = 0; i < opt_count; i++) {
+		obj = &objs[obj_count];
+		obj->child = obj->sibling = -1;
+		parent = dirs[rnd_range(dir_count)];
+		obj->parent = parent;
+		obj->depth = objs[parent].depth + 1;
+		obj->mtime = BASE_TIME + rnd_range(100000000);
+
+		r = rnd_range(100);
+		for (m = 0; m < MIX_ZERO; m++) {
+			if (r < mix[m])
+				break;
+			r -= mix[m];
+		}
+		if (m == MIX_DIR && obj->depth >= opt_depth)
+			m = MIX_ZERO;		/* too deep, a file instead */
+		switch (m) {
+			case MIX_DIR:
+				obj->type = YAFFS_OBJECT_TYPE_DIRECTORY;
+				obj->mode = S_IFDIR | (rnd_range(4) ? 0755 : 0700);
+				dirs[dir_count++] = obj_count;
+				break;
+			case MIX_SYMLINK:
+				obj->type = YAFFS_OBJECT_TYPE_SYMLINK;
+				obj->mode = S_IFLNK | 0777;
+				break;
+			case MIX_HARDLINK:
+				obj->type = YAFFS_OBJECT_TYPE_HARDLINK;
+				break;
+			case MIX_FIFO:
+				obj->type = YAFFS_OBJECT_TYPE_SPECIAL;
+				obj->mode = S_IFIFO | 0644;
+				break;
+			case MIX_DEVICE:
+				obj->type = YAFFS_OBJECT_TYPE_SPECIAL;
+				obj->mode = (rnd_range(2) ? S_IFCHR : S_IFBLK) | 0660;
+				obj->rdev = makedev(1 + rnd_range(250), rnd_range(256));
+				break;
+			default:
+				obj->type = YAFFS_OBJECT_TYPE_FILE;
+				obj->mode = S_IFREG | (rnd_range(4) ? 0644 : 0755);
+				obj->zero = rnd_range(100) < mix[MIX_ZERO];
+				obj->file_size = file_size();
+				break;
+		}
+		snprintf(obj->name, sizeof(obj->name), "%c%d",
+		         "?fldhs"[obj->type], obj_count);
+		add_child(parent, obj_count);
+		obj_count++;
+	}
+	free(dirs);
+}
+
+/* "other" ECC of yaffs_ecc.c, over the tags part of the packed tags */
+static void ecc_other(const unsigned char *data, unsigned len,
+                      yaffs_ECCOther *ecc) {
+	unsigned char col_parity, b;
+	unsigned line_parity, line_parity_prime, i;
+	int bit, parity, cp[6];
+
+	col_parity = 0;
+	line_parity = line_parity_prime = 0;
+	for (i = 0; i < len; i++) {
+		/* column parities cp0..cp5 of the byte and its parity */
+		memset(cp, 0, sizeof(cp));
+		parity = 0;
+		for (bit = 0; bit < 8; bit++) {
+			if (!(data[i] & (1 << bit)))
+				continue;
+			parity ^= 1;
+			cp[(bit & 1) ? 1 : 0] ^= 1;
+			cp[(bit & 2) ? 3 : 2] ^= 1;
+			cp[(bit & 4) ? 5 : 4] ^= 1;
+		}
+		b = parity | cp[0] << 2 | cp[1] << 3 | cp[2] << 4 |
+		    cp[3] << 5 | cp[4] << 6 | cp[5] << 7;
+		col_parity ^= b;
+		if (parity) {
+			line_parity ^= i;
+			line_parity_prime ^= ~i;
+		}
+	}
+	ecc->colParity = (col_parity >> 2) & 0x3f;
+	ecc->lineParity = line_parity;
+	ecc->lineParityPrime = line_parity_prime;
+}
+
+/* write chunk_buf with its tags, like write_chunk() of mkyaffs2image */
+static void write_chunk(unsigned id, unsigned chunk_id, unsigned bytes) {
+	yaffs_PackedTags2 pt;
+
+	pt.t.sequenceNumber = sequence;
+	pt.t.objectId = id;
+	pt.t.chunkId = chunk_id;
+	pt.t.byteCount = bytes;
+	ecc_other((unsigned char *)&pt.t, sizeof(pt.t), &pt.ecc);
+	memset(chunk_buf + chunk_size, 0xff, spare_size);
+	/* small spare areas (512 byte pages) only get the tags */
+	memcpy(chunk_buf + chunk_size, &pt,
+	       spare_size < (int)sizeof(pt) ? sizeof(pt.t) : sizeof(pt));
+	if (fwrite(chunk_buf, chunk_size + spare_size, 1, out) != 1)
+		prt_err(1, errno, "Can't write image");
+	chunks_total++;
+}
+
+/* erased chunks between the objects, up to the requested ratio */
+static void write_erased(void) {
+	while (chunks_erased * 100 < erased_pct * (chunks_total + 1)) {
+		memset(chunk_buf, 0xff, chunk_size + spare_size);
+		if (fwrite(chunk_buf, chunk_size + spare_size, 1, out) != 1)
+			prt_err(1, errno, "Can't write image");
+		chunks_total++;
+		chunks_erased++;
+	}
+}
+
+/* write the next data chunk of the interleaved files, round robin */
+static void write_interleaved(void) {
+	struct t_writing *w;
+	int len;
+
+	if (writing_next >= writing_count)
+		writing_next = 0;
+	w = &writing[writing_next];
+	len = w->obj->file_size - w->pos < chunk_size ? w->obj->file_size - w->pos
+	                                              : chunk_size;
+	memset(chunk_buf, 0xff, chunk_size);
+	file_data(w->obj, chunk_buf, w->pos, len);
+	write_chunk(w->obj->id, w->chunk_id++, len);
+	w->pos += len;
+	if (w->pos >= w->obj->file_size)	/* done */
+		*w = writing[--writing_count];
+	else
+		writing_next++;
+}
+
+/* chunk_buf with the object header of an object */
+static yaffs_ObjectHeader *object_header(t_object *obj) {
+	yaffs_ObjectHeader *oh;
+
+	memset(chunk_buf, 0xff, chunk_size);
+	oh = (yaffs_ObjectHeader *)chunk_buf;
+	oh->type = obj->type;
+	oh->parentObjectId = objs[obj->parent].id;
+	strncpy(oh->name, obj->name, YAFFS_MAX_NAME_LENGTH);
+	if (obj->type != YAFFS_OBJECT_TYPE_HARDLINK) {
+		oh->yst_mode = obj->mode;
+		oh->yst_uid = getuid();
+		oh->yst_gid = getgid();
+		oh->yst_atime = obj->mtime;
+		oh->yst_mtime = obj->mtime;
+		oh->yst_ctime = obj->mtime;
+		oh->yst_rdev = obj->rdev;
+	}
+	if (obj->type == YAFFS_OBJECT_TYPE_FILE)
+		oh->fileSize = obj->file_size;
+	if (obj->type == YAFFS_OBJECT_TYPE_HARDLINK)
+		oh->equivalentObjectId = objs[obj->equiv].id;
+	if (obj->type == YAFFS_OBJECT_TYPE_SYMLINK)
+		snprintf(oh->alias, sizeof(oh->alias), "../target/%s", obj->name);
+	oh->shadowsObject = 0;
+	oh->isShrink = 0;
+	return oh;
+}
+
+enum { DATA_ALL, DATA_ODD_STALE, DATA_ODD };
+
+/*
+ * data chunks of a file up to size: all of them, all with the odd ones
+ * stale (different data, rewritten later) or only the odd ones
+ */
+static void write_data(t_object *obj, long long size, int which) {
+	long long pos;
+	int len, chunk_id;
+
+	for (pos = 0, chunk_id = 1; pos < size; pos += len, chunk_id++) {
+		len = size - pos < chunk_size ? size - pos : chunk_size;
+		if (which == DATA_ODD && chunk_id % 2 == 0)
+			continue;
+		memset(chunk_buf, 0xff, chunk_size);
+		if (which == DATA_ODD_STALE && chunk_id % 2 == 1)
+			fill_data(~obj->id, chunk_buf, pos, len);
+		else
+			file_data(obj, chunk_buf, pos, len);
+		write_chunk(obj->id, chunk_id, len);
+	}
+}
+
+/* write the following chunks as the newer (1) or the older version */
+static void set_version(int newer) {
+	out = newer ? out_new : out_old;
+	sequence = newer ? SEQUENCE_NUMBER + 1 : SEQUENCE_NUMBER;
+}
+
+enum { UPD_NONE, UPD_RENAME, UPD_SHADOW, UPD_REWRITE, UPD_SHRINK,
+       UPD_DELETE };
+
+/*
+ * the older version of an object (-u), a function of the object id,
+ * as the random numbers must be the same for option -c
+ */
+static int update_kind(t_object *obj) {
+	unsigned long long h;
+	int kind;
+
+	h = data_word(obj->id, ~0ULL);
+	if (obj->parent < 0 || h % 100 >= (unsigned)opt_update)
+		return UPD_NONE;
+	kind = UPD_RENAME + (h >> 32) % 5;
+	if ((kind == UPD_REWRITE || kind == UPD_SHRINK) &&
+	    obj->type != YAFFS_OBJECT_TYPE_FILE)
+		kind = UPD_RENAME;
+	return kind;
+}
+
+static void write_object(t_object *obj) {
+	yaffs_ObjectHeader *oh;
+	t_object x;
+	int kind, old_size;
+
+	/*
+	 * with -u: a file deleted later, or shadowed by the object when
+	 * it's renamed over it (and still written to afterwards)
+	 */
+	kind = update_kind(obj);
+	if (kind == UPD_DELETE || kind == UPD_SHADOW) {
+		memset(&x, 0, sizeof(x));
+		x.type = YAFFS_OBJECT_TYPE_FILE;
+		x.parent = obj->parent;
+		x.id = next_extra_id++;
+		x.mode = S_IFREG | 0644;
+		x.mtime = obj->mtime;
+		x.file_size = chunk_size + 1 + data_word(x.id, 0) % chunk_size;
+		if (kind == UPD_SHADOW)
+			strcpy(x.name, obj->name);
+		else
+			snprintf(x.name, sizeof(x.name), "x%d", (int)(obj - objs));
+		object_header(&x);
+		write_chunk(x.id, 0, 0xffff);
+		write_data(&x, x.file_size, DATA_ALL);
+	}
+
+	oh = object_header(obj);
+	if (kind == UPD_RENAME || kind == UPD_SHADOW) {
+		oh->parentObjectId = OBJECTID_ROOT;
+		snprintf(oh->name, sizeof(oh->name), "r%d", (int)(obj - objs));
+	}
+	old_size = obj->file_size;
+	if (kind == UPD_SHRINK) {
+		old_size += 2 * chunk_size + 100;
+		oh->fileSize = old_size;
+	}
+	write_chunk(obj->id, 0, 0xffff);
+
+	if (opt_interleave > 0) {
+		if (obj->file_size > 0) {
+			writing[writing_count].obj = obj;
+			writing[writing_count].pos = 0;
+			writing[writing_count++].chunk_id = 1;
+		}
+		while (writing_count >= opt_interleave)
+			write_interleaved();
+		write_erased();
+		return;
+	}
+	write_data(obj, old_size, kind == UPD_REWRITE ? DATA_ODD_STALE : DATA_ALL);
+
+	if (kind != UPD_NONE) {
+		set_version(1);
+		switch (kind) {
+			case UPD_RENAME:
+			case UPD_SHADOW:
+				oh = object_header(obj);
+				if (kind == UPD_SHADOW)
+					oh->shadowsObject = x.id;
+				write_chunk(obj->id, 0, 0xffff);
+				if (kind == UPD_SHADOW)
+					write_data(&x, chunk_size, DATA_ALL);
+				break;
+			case UPD_REWRITE:
+				write_data(obj, obj->file_size, DATA_ODD);
+				object_header(obj);
+				write_chunk(obj->id, 0, 0xffff);
+				break;
+			case UPD_SHRINK:
+				oh = object_header(obj);
+				oh->isShrink = 1;
+				write_chunk(obj->id, 0, 0xffff);
+				break;
+			case UPD_DELETE:
+				oh = object_header(&x);
+				memset(oh->name, 0, sizeof(oh->name));
+				if (x.id % 2) {
+					oh->parentObjectId = OBJECTID_UNLINKED;
+					strcpy(oh->name, "unlinked");
+				} else {
+					oh->parentObjectId = OBJECTID_DELETED;
+					strcpy(oh->name, "deleted");
+					oh->fileSize = 0;
+				}
+				write_chunk(x.id, 0, 0xffff);
+				break;
+		}
+		set_version(0);
+	}
+	write_erased();
+}
+
+/*
+ * assign object ids in depth-first order, like mkyaffs2image.
+ * Hardlinks get a target among the files before them, without one
+ * they become a regular file.
+ */
+static void walk(int idx, int write) {
+	t_object *obj;
+	int c;
+
+	for (c = objs[idx].child; c >= 0; c = objs[c].sibling) {
+		obj = &objs[c];
+		obj->id = next_id++;
+		if (obj->type == YAFFS_OBJECT_TYPE_HARDLINK) {
+			if (file_count > 0)
+				obj->equiv = file_idx[rnd_range(file_count)];
+			else {
+				obj->type = YAFFS_OBJECT_TYPE_FILE;
+				obj->mode = S_IFREG | 0644;
+				obj->file_size = file_size();
+			}
+		}
+		if (obj->type == YAFFS_OBJECT_TYPE_FILE)
+			file_idx[file_count++] = c;
+		if (write)
+			write_object(obj);
+		if (obj->type == YAFFS_OBJECT_TYPE_DIRECTORY)
+			walk(c, write);
+	}
+}
+
+/*
+ * Check mode (option -c): compare an extracted tree with the objects
+ */
+static void check_err(const char *path, const char *format, ...) {
+	va_list varg;
+
+	va_start(varg, format);
+	fprintf(stderr, "%s: ", path);
+	vfprintf(stderr, format, varg);
+	fprintf(stderr, "\n");
+	va_end(varg);
+	errors++;
+}
+
+/* path of an object below the base dir, returns its length */
+static size_t obj_path(char *buf, size_t size, const char *base, int idx) {
+	size_t len;
+
+	if (objs[idx].parent < 0)
+		return snprintf(buf, size, "%s", base);
+	len = obj_path(buf, size, base, objs[idx].parent);
+	if (len < size)
+		len += snprintf(buf + len, size - len, "/%s", objs[idx].name);
+	return len;
+}
+
+static void check_data(const char *path, t_object *obj) {
+	unsigned char *buf, *exp;
+	long long pos;
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		check_err(path, "can't open: %s", strerror(errno));
+		return;
+	}
+	if ((buf = malloc(2 * chunk_size)) == NULL)
+		prt_err(1, 0, "Malloc check buffer failed.");
+	exp = buf + chunk_size;
+	for (pos = 0; pos < obj->file_size; pos += len) {
+		len = read(fd, buf, chunk_size);
+		if (len <= 0) {
+			check_err(path, "can't read at %lld", pos);
+			break;
+		}
+		file_data(obj, exp, pos, len);
+		if (memcmp(buf, exp, len) != 0) {
+			check_err(path, "data differs at %lld", pos);
+			break;
+		}
+	}
+	free(buf);
+	close(fd);
+}
+
+static int count_entries(const char *path) {
+	struct dirent *de;
+	DIR *dir;
+	int n;
+
+	if ((dir = opendir(path)) == NULL)
+		return -1;
+	n = 0;
+	while ((de = readdir(dir)) != NULL)
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			n++;
+	closedir(dir);
+	return n;
+}
+
+static void check_tree(const char *base) {
+	char path[4096], eq_path[4096], link[256];
+	struct stat st, eq_st;
+	t_object *obj;
+	int i, children, c;
+	ssize_t len;
+
+	for (i = 0; i < obj_count; i++) {
+		obj = &objs[i];
+		obj_path(path, sizeof(path), base, i);
+		if (lstat(path, &st) < 0) {
+			if (obj->type != YAFFS_OBJECT_TYPE_SPECIAL ||
+			    S_ISFIFO(obj->mode) || getuid() == 0)
+				check_err(path, "missing");
+			continue;
+		}
+		switch (obj->type) {
+			case YAFFS_OBJECT_TYPE_DIRECTORY:
+				for (children = 0, c = obj->child; c >= 0; c = objs[c].sibling)
+					children++;
+				if (!S_ISDIR(st.st_mode))
+					check_err(path, "not a directory");
+				else if (count_entries(path) < children)
+					check_err(path, "missing entries");
+				else if (count_entries(path) > children)
+					check_err(path, "extra entries");
+				break;
+			case YAFFS_OBJECT_TYPE_FILE:
+				if (!S_ISREG(st.st_mode))
+					check_err(path, "not a regular file");
+				else if (st.st_size != obj->file_size)
+					check_err(path, "size %lld instead of %d",
+					          (long long)st.st_size, obj->file_size);
+				else
+					check_data(path, obj);
+				break;
+			case YAFFS_OBJECT_TYPE_SYMLINK:
+				len = readlink(path, link, sizeof(link) - 1);
+				link[len > 0 ? len : 0] = '\0';
+				if (!S_ISLNK(st.st_mode))
+					check_err(path, "not a symlink");
+				else if (strncmp(link, "../target/", 10) != 0 ||
+				         strcmp(link + 10, obj->name) != 0)
+					check_err(path, "wrong link target %s", link);
+				break;
+			case YAFFS_OBJECT_TYPE_HARDLINK:
+				obj_path(eq_path, sizeof(eq_path), base, obj->equiv);
+				if (lstat(eq_path, &eq_st) < 0 ||
+				    st.st_ino != eq_st.st_ino || st.st_dev != eq_st.st_dev)
+					check_err(path, "not linked to %s", eq_path);
+				continue;		/* attributes are the target's */
+			case YAFFS_OBJECT_TYPE_SPECIAL:
+				if ((st.st_mode & S_IFMT) != (obj->mode & S_IFMT))
+					check_err(path, "wrong file type");
+				else if (!S_ISFIFO(st.st_mode) && st.st_rdev != obj->rdev)
+					check_err(path, "wrong device number");
+				break;
+		}
+		if (i == 0)			/* the base dir */
+			continue;
+		if (!S_ISLNK(st.st_mode) && (st.st_mode & 07777) != (obj->mode & 07777))
+			check_err(path, "mode %o instead of %o",
+			          st.st_mode & 07777, obj->mode & 07777);
+		if (st.st_mtime != obj->mtime)
+			check_err(path, "wrong modification time");
+		if (errors > 100)
+			prt_err(1, 0, "Too many differences");
+	}
+}
+
+static void parse_mix(char *arg) {
+	char *item, *val;
+	int m;
+
+	for (item = strtok(arg, ","); item != NULL; item = strtok(NULL, ",")) {
+		if ((val = strchr(item, '=')) == NULL)
+			prt_err(1, 0, "Invalid mix %s, use <type>=<percent>", item);
+		*val++ = '\0';
+		for (m = 0; m < MIX_COUNT && strcmp(item, mix_names[m]) != 0; m++);
+		if (m >= MIX_COUNT)
+			prt_err(1, 0, "Unknown object type %s", item);
+		mix[m] = atoi(val);
+	}
+	for (m = 0; m < MIX_COUNT; m++)
+		if (mix[m] < 0 || mix[m] > 100)
+			prt_err(1, 0, "Invalid object mix");
+}
+
+void usage(void) {
+	fprintf(stderr, "\
+yaffsgen - generate a synthetic YAFFS2 file system image.\n\
+\n\
+Usage: yaffsgen [options] <image_file_name>\n\
+       yaffsgen [options] -c <dir>\n\
+    -c <dir>         check the tree extracted to <dir>, instead of\n\
+                     writing the image (use the same options)\n\
+    -d <depth>       maximum directory depth (default 5)\n\
+    -e <percent>     ratio of erased chunks (default 0)\n\
+    -i <files>       interleave the data chunks of <files> files\n\
+    -l <layout>      flash memory layout (like unyaffs -l, default 1)\n\
+                     or <chunk size>,<spare size>\n\
+    -m <mix>         object mix in percent, a comma separated list of\n\
+                     <type>=<percent> with type dir, symlink, hardlink,\n\
+                     fifo, device (the rest are regular files) and\n\
+                     zero (zero filled files)\n\
+                     (default dir=10,symlink=3,hardlink=2,fifo=1,\n\
+                     device=0,zero=5)\n\
+    -n <count>       number of objects (default 1000)\n\
+    -r <seed>        random seed (default 1)\n\
+    -s <min>-<max>   file sizes in bytes, log-uniform\n\
+                     (default 0-1048576)\n\
+    -u <percent>     write older versions of <percent> of the objects\n\
+                     first, for unyaffs -f (renamed, shadowed, rewritten,\n\
+                     shrunk and deleted objects, default 0)\n\
+");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	char *check_dir, *end;
+	int ch, i, total;
+
+	check_dir = NULL;
+	while ((ch = getopt(argc, argv, "c:d:e:i:l:m:n:r:s:u:h?")) > 0) {
+		switch (ch) {
+			case 'c':
+				check_dir = optarg;
+				break;
+			case 'd':
+				opt_depth = atoi(optarg);
+				if (opt_depth < 1) usage();
+				break;
+			case 'e':
+				erased_pct = atoi(optarg);
+				if (erased_pct < 0 || erased_pct > 90) usage();
+				break;
+			case 'i':
+				opt_interleave = atoi(optarg);
+				if (opt_interleave < 0) usage();
+				break;
+			case 'l':
+				if (strchr(optarg, ',') != NULL) {
+					chunk_size = strtol(optarg, &end, 10);
+					spare_size = strtol(end + 1, &end, 10);
+					if (*end != '\0' ||
+					    chunk_size < (int)sizeof(yaffs_ObjectHeader) ||
+					    chunk_size > 16384 ||
+					    spare_size < (int)sizeof(yaffs_PackedTags2TagsPart) ||
+					    spare_size > 1280) usage();
+					break;
+				}
+				i = atoi(optarg);
+				if (i < 1 || i > 4) usage();
+				chunk_size = possible_layouts[i-1].chunk_size;
+				spare_size = possible_layouts[i-1].spare_size;
+				break;
+			case 'm':
+				parse_mix(optarg);
+				break;
+			case 'n':
+				opt_count = atoi(optarg);
+				if (opt_count < 0) usage();
+				break;
+			case 'r':
+				seed = strtoull(optarg, &end, 10);
+				if (*end != '\0') usage();
+				break;
+			case 's':
+				size_min = strtol(optarg, &end, 10);
+				if (*end != '-') usage();
+				size_max = strtol(end + 1, &end, 10);
+				if (*end != '\0' || size_min < 0 || size_max < size_min)
+					usage();
+				break;
+			case 'u':
+				opt_update = atoi(optarg);
+				if (opt_update < 0 || opt_update > 100) usage();
+				break;
+			case 'h':
+			case '?':
+			default:
+				usage();
+				break;
+		}
+	}
+	if ((argc - optind) != (check_dir != NULL ? 0 : 1))
+		usage();
+	for (i = 0, total = 0; i < MIX_ZERO; i++)
+		total += mix[i];
+	if (total > 100)
+		prt_err(1, 0, "Object mix exceeds 100%%");
+	if (opt_update > 0 && opt_interleave > 0)
+		prt_err(1, 0, "Options -i and -u can't be used together");
+
+	seed = seed * 0x9e3779b97f4a7c15ULL + 1;	/* no zero state */
+	build_tree();
+	next_id = FIRST_OBJECT_ID;
+	next_extra_id = FIRST_OBJECT_ID + opt_count;
+
+	if (check_dir != NULL) {
+		walk(0, 0);
+		check_tree(check_dir);
+		if (errors > 0)
+			prt_err(1, 0, "%d differences", errors);
+		return 0;
+	}
+
+	if ((out_new = fopen(argv[optind], "w")) == NULL)
+		prt_err(1, errno, "Can't create image %s", argv[optind]);
+	setvbuf(out_new, NULL, _IOFBF, 1024*1024);
+	out_old = out_new;
+	if (opt_update > 0 && (out_old = tmpfile()) == NULL)
+		prt_err(1, errno, "Can't create temporary file");
+	set_version(0);
+	if ((chunk_buf = malloc(chunk_size + spare_size)) == NULL ||
+	    (writing = malloc((opt_interleave + 1) * sizeof(*writing))) == NULL)
+		prt_err(1, 0, "Malloc chunk buffer failed.");
+	walk(0, 1);
+	while (writing_count > 0)
+		write_interleaved();
+	if (out_old != out_new) {		/* older versions behind */
+		rewind(out_old);
+		while ((i = fread(chunk_buf, 1, chunk_size + spare_size, out_old)) > 0)
+			if (fwrite(chunk_buf, i, 1, out_new) != 1)
+				prt_err(1, errno, "Can't write image");
+		if (ferror(out_old))
+			prt_err(1, errno, "Can't read temporary file");
+		fclose(out_old);
+	}
+	if (fclose(out_new) != 0)
+		prt_err(1, errno, "Can't write image");
+	free(chunk_buf);
+	free(writing);
+	return 0;
+}